@@ -12,3 +12,5 @@ clang $CFLAGS -o ./build/demos/adder demos/adder.c $LIBS
 clang $CFLAGS -o ./build/demos/img2nn demos/img2nn.c $LIBS
 clang $CFLAGS -o ./build/demos/layout demos/layout.c $LIBS
 clang $CFLAGS -o ./build/demos/shape demos/shape.c $LIBS
+clang $CFLAGS -o ./build/demos/viewer demos/viewer.c $LIBS
+clang -O3 -Wall -Wextra -ggdb -I./thirdparty/ -I. -o ./build/demos/train demos/train.c -lm -lpthread
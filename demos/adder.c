@@ -9,12 +9,17 @@
 size_t arch[] = {2*BITS, 4*BITS, BITS + 1};
 size_t epoch = 0;
 size_t max_epoch = 100*1000;
-size_t batches_per_frame = 200;
 size_t batch_size = 28;
 float rate = 1.0f;
 bool paused = true;
 
-void verify_nn_adder(Font font, NN nn, Gym_Rect r)
+// The answers and the cost of the NN, only recomputed after it learned something
+Gym_NN_Stamp verify_stamp = {0};
+size_t verify_z[1<<BITS][1<<BITS];
+bool verify_overflow[1<<BITS][1<<BITS];
+float verify_cost = 0;
+
+void verify_nn_adder(Font font, NN nn, Mat t, Gym_Rect r)
 {
     float s;
     if (r.w < r.h) {
@@ -27,21 +32,32 @@ void verify_nn_adder(Font font, NN nn, Gym_Rect r)
     size_t n = 1<<BITS;
     float cs = s/n;
 
-    for (size_t x = 0; x < n; ++x) {
-        for (size_t y = 0; y < n; ++y) {
-            for (size_t i = 0; i < BITS; ++i) {
-                ROW_AT(NN_INPUT(nn), i)        = (x>>i)&1;
-                ROW_AT(NN_INPUT(nn), i + BITS) = (y>>i)&1;
+    if (gym_nn_stamp_update(&verify_stamp, nn, NULL, 0)) {
+        for (size_t x = 0; x < n; ++x) {
+            for (size_t y = 0; y < n; ++y) {
+                for (size_t i = 0; i < BITS; ++i) {
+                    ROW_AT(NN_INPUT(nn), i)        = (x>>i)&1;
+                    ROW_AT(NN_INPUT(nn), i + BITS) = (y>>i)&1;
+                }
+
+                nn_forward(nn);
+
+                size_t z = 0.0f;
+                for (size_t i = 0; i < BITS; ++i) {
+                    size_t bit = ROW_AT(NN_OUTPUT(nn), i) > 0.5;
+                    z = z|(bit<<i);
+                }
+                verify_z[x][y] = z;
+                verify_overflow[x][y] = ROW_AT(NN_OUTPUT(nn), BITS) > 0.5;
             }
+        }
+        verify_cost = nn_cost(nn, t);
+    }
 
-            nn_forward(nn);
-
-            size_t z = 0.0f;
-            for (size_t i = 0; i < BITS; ++i) {
-                size_t bit = ROW_AT(NN_OUTPUT(nn), i) > 0.5;
-                z = z|(bit<<i);
-            }
-            bool overflow = ROW_AT(NN_OUTPUT(nn), BITS) > 0.5;
+    for (size_t x = 0; x < n; ++x) {
+        for (size_t y = 0; y < n; ++y) {
+            size_t z = verify_z[x][y];
+            bool overflow = verify_overflow[x][y];
             bool correct = z == x + y;
 
             Vector2 position = { r.x + x*cs, r.y + y*cs };
@@ -67,7 +83,7 @@ void verify_nn_adder(Font font, NN nn, Gym_Rect r)
 
 int main(void)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
+    Region temp = region_alloc_growable(1024*1024, 0);
 
     size_t n = (1<<BITS);
     size_t rows = n*n;
@@ -103,7 +119,8 @@ int main(void)
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "xor");
-    SetTargetFPS(60);
+    Gym_Frame_Budget frame;
+    gym_frame_budget_init(&frame);
 
     Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
@@ -118,19 +135,23 @@ int main(void)
         if (IsKeyPressed(KEY_R)) {
             epoch = 0;
             nn_rand(nn, -1, 1);
-            plot.count = 0;
+            gym_plot_reset(&plot);
         }
 
-        for (size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i) {
+        Train_Budget *train = gym_frame_train(&frame);
+        while (!paused && epoch < max_epoch && train_budget_next(train)) {
+            size_t s = region_save(&temp);
             batch_process(&temp, &batch, batch_size, nn, t, rate);
             if (batch.finished) {
                 epoch += 1;
-                da_append(&plot, batch.cost);
+                gym_plot_push(&plot, batch.cost);
                 mat_shuffle_rows(t);
             }
+            region_rewind(&temp, s);
         }
+        gym_frame_draw(&frame);
 
-        BeginDrawing();
+        gym_begin_drawing();
         ClearBackground(GYM_BACKGROUND);
         {
             int w = GetRenderWidth();
@@ -148,14 +169,15 @@ int main(void)
                     gym_render_nn(nn, gym_layout_slot());
                     gym_render_nn_weights_heatmap(nn, gym_layout_slot());
                 gym_layout_end();
-                verify_nn_adder(font, nn, gym_layout_slot());
+                verify_nn_adder(font, nn, t, gym_layout_slot());
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, nn_cost(nn, t), region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, verify_cost, region_occupied_bytes(&temp));
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
         }
-        EndDrawing();
+        gym_end_drawing();
+        gym_frame_end(&frame);
 
         region_reset(&temp);
     }
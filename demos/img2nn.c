@@ -7,6 +7,7 @@
 #include <raylib.h>
 #include <raymath.h>
 
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -22,7 +23,6 @@
 
 size_t arch[] = {3, 28, 28, 9, 1};
 size_t max_epoch = 100*1000;
-size_t batches_per_frame = 200;
 size_t batch_size = 28;
 float rate = 1.0f;
 float scroll = 0.f;
@@ -39,35 +39,119 @@ char *args_shift(int *argc, char ***argv)
 
 #define out_width 512
 #define out_height 512
+// Largest error of the adaptive renderer used for the screenshots
+#define out_tolerance (1.f/255.f)
 uint32_t out_pixels[out_width*out_height];
 #define FPS 30
 #define STR2(x) #x
 #define STR(x) STR2(x)
 #define READ_END 0
 #define WRITE_END 1
-
-void render_single_out_image(NN nn, float a)
+// Frames rendered ahead of the one being piped to ffmpeg
+#define FRAMES_IN_FLIGHT 16
+// Pixel format of the exported videos. YUV420P is 1.5 bytes per pixel instead
+// of 4 and is what libx264 encodes anyway. GYM_PIXEL_GRAY is smaller still,
+// but ffmpeg has to convert it before encoding.
+#define VIDEO_FORMAT GYM_PIXEL_YUV420P
+
+// Square in the middle of the output image the network is rendered into
+size_t out_square(size_t *px, size_t *py)
 {
-    for (size_t i = 0; i < out_width*out_height; ++i) {
-        out_pixels[i] = 0xFF000000;
-    }
-
-    size_t px, py, size;
+    size_t size;
     if (out_width > out_height) {
         size = out_height;
-        px = out_width/2 - size/2;
-        py = 0;
+        *px = out_width/2 - size/2;
+        *py = 0;
     } else {
         size = out_width;
-        px = 0;
-        py = out_height/2 - size/2;
+        *px = 0;
+        *py = out_height/2 - size/2;
+    }
+    return size;
+}
+
+void render_single_out_image(NN nn, float a, Pool *pool)
+{
+    for (size_t i = 0; i < out_width*out_height; ++i) {
+        out_pixels[i] = 0xFF000000;
     }
 
+    size_t px, py;
+    size_t size = out_square(&px, &py);
     ROW_AT(NN_INPUT(nn), 2) = a;
-    gym_nn_image_grayscale(nn, &out_pixels[py*out_width + px], size, size, out_width, 0, 1);
+    gym_nn_image_grayscale_adaptive(nn, &out_pixels[py*out_width + px], size, size, out_width, 0, 1, out_tolerance, pool);
 }
 
-int render_upscaled_video(NN nn, float duration, const char *out_file_path)
+// The image input of the given frame of the video, it goes 0 -> 1 -> 1 -> 0
+float video_frame_input(size_t frame, size_t frame_count)
+{
+    typedef struct {
+        float start;
+        float end;
+    } Segment;
+
+    Segment segments[] = {
+        {0, 0},
+        {0, 1},
+        {1, 1},
+        {1, 0},
+    };
+    size_t segments_count = ARRAY_LEN(segments);
+    float segment_length = 1.0f/segments_count;
+
+    float a = ((float)frame)/frame_count;
+    size_t segment_index = floorf(a/segment_length);
+    float segment_progress = a/segment_length - segment_index;
+    if (segment_index >= segments_count) segment_index = segments_count - 1;
+    Segment segment = segments[segment_index];
+    return segment.start + (segment.end - segment.start)*sqrtf(segment_progress);
+}
+
+typedef struct {
+    NN nn;
+    // Only the image input changes between the frames, so the separable part
+    // of the first layer is shared by all of them
+    Gym_NN_Grid grid;
+    size_t frame_count;
+} Video;
+
+void render_video_frame(void *arg, size_t frame, void *pixels, Region *scratch)
+{
+    Video *video = arg;
+    gym_frame_clear(pixels, VIDEO_FORMAT, out_width, out_height);
+
+    Row input = row_alloc(scratch, NN_INPUT(video->nn).cols);
+    row_copy(input, NN_INPUT(video->nn));
+    ROW_AT(input, 2) = video_frame_input(frame, video->frame_count);
+
+    size_t px, py;
+    out_square(&px, &py);
+    // Every frame is rendered by a single worker, the pool is busy with the
+    // other frames
+    gym_nn_grid_render_format(&video->grid, video->nn, input, gym_frame_at(pixels, VIDEO_FORMAT, out_width, px, py), out_width, 0, 1, VIDEO_FORMAT, NULL);
+}
+
+// Renders the frames of the video in VIDEO_FORMAT and writes them into fd
+bool render_video_frames(NN nn, float duration, int fd, Pool *pool)
+{
+    Video video = {
+        .nn = nn,
+        .frame_count = FPS*duration,
+    };
+    Region grid_region = region_alloc_growable(256*1024, 0);
+    size_t px, py;
+    size_t size = out_square(&px, &py);
+    gym_nn_grid_init(&grid_region, &video.grid, nn, size, size);
+
+    // The frames are rendered concurrently on the pool while the writer thread
+    // writes them in order
+    bool ok = gym_render_frames(fd, video.frame_count, gym_frame_size(VIDEO_FORMAT, out_width, out_height), FRAMES_IN_FLIGHT, render_video_frame, &video, pool);
+
+    region_free(&grid_region);
+    return ok;
+}
+
+int render_upscaled_video(NN nn, float duration, const char *out_file_path, Pool *pool)
 {
     int pipefd[2];
 
@@ -94,7 +178,7 @@ int render_upscaled_video(NN nn, float duration, const char *out_file_path)
             "-loglevel", "verbose",
             "-y",
             "-f", "rawvideo",
-            "-pix_fmt", "rgba",
+            "-pix_fmt", gym_pixel_format_name(VIDEO_FORMAT),
             "-s", STR(out_width) "x" STR(out_height),
             "-r", STR(FPS),
             "-an",
@@ -112,42 +196,45 @@ int render_upscaled_video(NN nn, float duration, const char *out_file_path)
 
     close(pipefd[READ_END]);
 
-    typedef struct {
-        float start;
-        float end;
-    } Segment;
-
-    Segment segments[] = {
-        {0, 0},
-        {0, 1},
-        {1, 1},
-        {1, 0},
-    };
-    size_t segments_count = ARRAY_LEN(segments);
-    float segment_length = 1.0f/segments_count;
-
-    size_t frame_count = FPS*duration;
-    for (size_t i = 0; i < frame_count; ++i) {
-        float a = ((float)i)/frame_count;
-        size_t segment_index = floorf(a/segment_length);
-        float segment_progress = a/segment_length - segment_index;
-        if (segment_index > segments_count) segment_index = segment_length - 1;
-        Segment segment = segments[segment_index];
-        float b = segment.start + (segment.end - segment.start)*sqrtf(segment_progress);
-        render_single_out_image(nn, b);
-        write(pipefd[WRITE_END], out_pixels, sizeof(*out_pixels)*out_width*out_height);
-        printf("a = %f, index = %zu, progress = %f, b = %f\n", a, segment_index, segment_progress, b);
-    }
+    bool ok = render_video_frames(nn, duration, pipefd[WRITE_END], pool);
 
     close(pipefd[WRITE_END]);
     wait(NULL);
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not generate %s\n", out_file_path);
+        return 1;
+    }
     printf("Generated %s!\n", out_file_path);
     return 0;
 }
 
-int render_upscaled_screenshot(NN nn, const char *out_file_path)
+// Dumps the raw frames into a file to be encoded later, so no ffmpeg is
+// needed while training
+int render_upscaled_raw(NN nn, float duration, const char *out_file_path, Pool *pool)
+{
+    int fd = open(out_file_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", out_file_path, strerror(errno));
+        return 1;
+    }
+
+    bool ok = render_video_frames(nn, duration, fd, pool);
+    if (close(fd) < 0) {
+        fprintf(stderr, "ERROR: could not close %s: %s\n", out_file_path, strerror(errno));
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not generate %s\n", out_file_path);
+        return 1;
+    }
+    printf("Generated %s! Encode it with:\n", out_file_path);
+    printf("    ffmpeg -f rawvideo -pix_fmt %s -s " STR(out_width) "x" STR(out_height) " -r " STR(FPS) " -i %s -c:v libx264 upscaled.mp4\n", gym_pixel_format_name(VIDEO_FORMAT), out_file_path);
+    return 0;
+}
+
+int render_upscaled_screenshot(NN nn, const char *out_file_path, Pool *pool)
 {
-    render_single_out_image(nn, scroll);
+    render_single_out_image(nn, scroll, pool);
 
     if (!stbi_write_png(out_file_path, out_width, out_height, 4, out_pixels, out_width*sizeof(*out_pixels))) {
         fprintf(stderr, "ERROR: could not save image %s\n", out_file_path);
@@ -219,7 +306,6 @@ Vector2 render_texture_in_slot(Texture2D texture, Gym_Horz_Align ha, Gym_Vert_Al
 
 int main(int argc, char **argv)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
 
     const char *program = args_shift(&argc, &argv);
 
@@ -264,26 +350,13 @@ int main(int argc, char **argv)
 
     NN nn = nn_alloc(NULL, arch, ARRAY_LEN(arch));
 
-    Mat t = mat_alloc(NULL, img1_width*img1_height + img2_width*img2_height, NN_INPUT(nn).cols + NN_OUTPUT(nn).cols);
-    for (int y = 0; y < img1_height; ++y) {
-        for (int x = 0; x < img1_width; ++x) {
-            size_t i = y*img1_width + x;
-            MAT_AT(t, i, 0) = (float)x/(img1_width - 1);
-            MAT_AT(t, i, 1) = (float)y/(img1_height - 1);
-            MAT_AT(t, i, 2) = 0.f;
-            MAT_AT(t, i, 3) = img1_pixels[i]/255.f;
-        }
-    }
-
-    for (int y = 0; y < img2_height; ++y) {
-        for (int x = 0; x < img2_width; ++x) {
-            size_t i = img1_width*img1_height + y*img2_width + x;
-            MAT_AT(t, i, 0) = (float)x/(img2_width - 1);
-            MAT_AT(t, i, 1) = (float)y/(img2_height - 1);
-            MAT_AT(t, i, 2) = 1.f;
-            MAT_AT(t, i, 3) = img2_pixels[y*img2_width + x]/255.f;
-        }
-    }
+    // Only the pixels are stored, the (x, y, image) inputs are derived from the row index
+    Dataset_Image images[] = {
+        { img1_pixels, img1_width, img1_height },
+        { img2_pixels, img2_width, img2_height },
+    };
+    Dataset t = dataset_from_image_coords(NULL, images, ARRAY_LEN(images));
+    NN_ASSERT(t.cols == NN_INPUT(nn).cols + NN_OUTPUT(nn).cols);
 
     nn_rand(nn, -1, 1);
 
@@ -293,7 +366,7 @@ int main(int argc, char **argv)
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "gym");
-    SetTargetFPS(60);
+    gym_set_target_fps(60);
 
     Gym_Plot plot = {0};
     Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
@@ -302,14 +375,11 @@ int main(int argc, char **argv)
     size_t preview_width = 28;
     size_t preview_height = 28;
 
-    Image preview_image1 = GenImageColor(preview_width, preview_height, BLACK);
-    Texture2D preview_texture1 = LoadTextureFromImage(preview_image1);
+    Gym_NN_Preview preview1 = gym_nn_preview_load(preview_width, preview_height);
 
-    Image preview_image2 = GenImageColor(preview_width, preview_height, BLACK);
-    Texture2D preview_texture2 = LoadTextureFromImage(preview_image2);
+    Gym_NN_Preview preview2 = gym_nn_preview_load(preview_width, preview_height);
 
-    Image preview_image3 = GenImageColor(preview_width, preview_height, BLACK);
-    Texture2D preview_texture3 = LoadTextureFromImage(preview_image3);
+    Gym_NN_Preview preview3 = gym_nn_preview_load(preview_width, preview_height);
 
     Image original_image1 = GenImageColor(img1_width, img1_height, BLACK);
     for (size_t y = 0; y < (size_t) img1_height; ++y) {
@@ -333,49 +403,51 @@ int main(int argc, char **argv)
     }
     Texture2D original_texture2 = LoadTextureFromImage(original_image2);
 
-    Batch batch = {0};
     bool rate_dragging = false;
     bool scroll_dragging = false;
-    size_t epoch = 0;
+
+    // Renders the exported screenshots and videos
+    Pool pool;
+    if (!pool_init(&pool, 0)) return 1;
+
+    // Training runs on its own thread at full speed, the frames only draw the
+    // latest snapshot of it
+    Gym_Trainer trainer;
+    if (!gym_trainer_start(&trainer, nn, t, batch_size, rate, max_epoch)) return 1;
+    gym_trainer_set_paused(&trainer, paused);
 
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
             paused = !paused;
+            gym_trainer_set_paused(&trainer, paused);
         }
         if (IsKeyPressed(KEY_R)) {
-            epoch = 0;
-            nn_rand(nn, -1, 1);
-            plot.count = 0;
+            gym_trainer_reset(&trainer);
         }
+
+        Gym_Snapshot *snapshot = gym_trainer_acquire(&trainer, &plot);
+        NN view = snapshot->nn;
+
         if (IsKeyPressed(KEY_S)) {
-            render_upscaled_screenshot(nn, "upscaled.png");
+            render_upscaled_screenshot(view, "upscaled.png", &pool);
         }
         if (IsKeyPressed(KEY_X)) {
-            render_upscaled_video(nn, 5, "upscaled.mp4");
+            render_upscaled_video(view, 5, "upscaled.mp4", &pool);
         }
-
-        for (size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i) {
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
-            if (batch.finished) {
-                epoch += 1;
-                da_append(&plot, batch.cost);
-                mat_shuffle_rows(t);
-            }
+        if (IsKeyPressed(KEY_V)) {
+            render_upscaled_raw(view, 5, "upscaled.yuv", &pool);
         }
 
-        ROW_AT(NN_INPUT(nn), 2) = 0.f;
-        gym_nn_image_grayscale(nn, preview_image1.data, preview_image1.width, preview_image1.height, preview_image1.width, 0, 1);
-        UpdateTexture(preview_texture1, preview_image1.data);
+        ROW_AT(NN_INPUT(view), 2) = 0.f;
+        gym_nn_preview_update(&preview1, view, NULL);
 
-        ROW_AT(NN_INPUT(nn), 2) = 1.f;
-        gym_nn_image_grayscale(nn, preview_image2.data, preview_image2.width, preview_image2.height, preview_image2.width, 0, 1);
-        UpdateTexture(preview_texture2, preview_image2.data);
+        ROW_AT(NN_INPUT(view), 2) = 1.f;
+        gym_nn_preview_update(&preview2, view, NULL);
 
-        ROW_AT(NN_INPUT(nn), 2) = scroll;
-        gym_nn_image_grayscale(nn, preview_image3.data, preview_image3.width, preview_image3.height, preview_image3.width, 0, 1);
-        UpdateTexture(preview_texture3, preview_image3.data);
+        ROW_AT(NN_INPUT(view), 2) = scroll;
+        gym_nn_preview_update(&preview3, view, NULL);
 
-        BeginDrawing();
+        gym_begin_drawing();
         ClearBackground(GYM_BACKGROUND);
         {
             int w = GetRenderWidth();
@@ -389,7 +461,7 @@ int main(int argc, char **argv)
 
             gym_layout_begin(GLO_HORZ, r, 3, 10);
                 gym_plot(plot, gym_layout_slot(), RED);
-                gym_render_nn_weights_heatmap(nn, gym_layout_slot());
+                gym_render_nn_weights_heatmap(view, gym_layout_slot());
                 Gym_Rect preview_slot = gym_layout_slot();
                 gym_layout_begin(GLO_VERT, preview_slot, 3, 0);
                     gym_layout_begin(GLO_HORZ, gym_layout_slot(), 2, 0);
@@ -397,10 +469,10 @@ int main(int argc, char **argv)
                         render_texture_in_slot(original_texture2, GHA_LEFT, GVA_BOTTOM, gym_layout_slot());
                     gym_layout_end();
                     gym_layout_begin(GLO_HORZ, gym_layout_slot(), 2, 0);
-                        render_texture_in_slot(preview_texture1, GHA_RIGHT, GVA_TOP, gym_layout_slot());
-                        render_texture_in_slot(preview_texture2, GHA_LEFT, GVA_TOP, gym_layout_slot());
+                        render_texture_in_slot(preview1.texture, GHA_RIGHT, GVA_TOP, gym_layout_slot());
+                        render_texture_in_slot(preview2.texture, GHA_LEFT, GVA_TOP, gym_layout_slot());
                     gym_layout_end();
-                    render_texture_in_slot(preview_texture3, GHA_CENTER, GVA_CENTER, gym_layout_slot());
+                    render_texture_in_slot(preview3.texture, GHA_CENTER, GVA_CENTER, gym_layout_slot());
                 gym_layout_end();
                 {
                     float rw = preview_slot.w;
@@ -412,14 +484,18 @@ int main(int argc, char **argv)
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, plot.count > 0 ? plot.items[plot.count - 1] : 0, region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Batches: %zu\n", snapshot->epoch, max_epoch, rate, snapshot->cost, snapshot->batches);
             DrawTextEx(font, buffer, CLITERAL(Vector2) {}, h*0.04, 0, WHITE);
             gym_slider(&rate, &rate_dragging, 0, h*0.08, w, h*0.02);
         }
-        EndDrawing();
+        gym_end_drawing();
 
-        region_reset(&temp);
+        gym_trainer_set_rate(&trainer, rate);
     }
 
+    gym_trainer_stop(&trainer);
+    pool_free(&pool);
+    pool_scratch_release();
+
     return 0;
 }
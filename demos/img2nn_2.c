@@ -2,12 +2,14 @@
 #include <stdio.h>
 #include <float.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <string.h>
 
 #include <raylib.h>
 #include <raymath.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -24,8 +26,10 @@
 size_t arch[] = {3, 28, 28,  9, 1};
 
 size_t max_epoch = 100 * 1000;
-size_t batches_per_frame = 200;
 size_t batch_size = 28;
+size_t checkpoint_every = 100;
+size_t max_previews = 16;
+#define CHECKPOINT_FILE_PATH "img2nn.ckpt"
 
 float rate = 1.0f;
 float scroll = 0.f;
@@ -43,39 +47,123 @@ char *args_shift(int *argc, char ***argv)
 
 #define out_width 512
 #define out_height 512
+/* largest error of the adaptive renderer used for the screenshots */
+#define out_tolerance (1.f/255.f)
 uint32_t out_pixels[out_width * out_height];
 #define FPS 30
 #define STR2(x) #x
 #define STR(x) STR2(x)
 #define READ_END 0
 #define WRITE_END 1
-
-void render_single_out_image(NN nn, float a)
+/* frames rendered ahead of the one being piped to ffmpeg */
+#define FRAMES_IN_FLIGHT 16
+/* pixel format of the exported videos, yuv420p is 1.5 bytes per pixel instead of 4
+   and is what libx264 encodes anyway. gray is smaller still but ffmpeg has to convert it */
+#define VIDEO_FORMAT GYM_PIXEL_YUV420P
+
+/* square in the middle of the output image the network is rendered into */
+size_t out_square(size_t *px, size_t *py)
 {
-    for (size_t i = 0; i < out_width * out_height; ++i)
-    {
-        out_pixels[i] = 0xFF000000;
-    }
-
-    size_t px, py, size;
+    size_t size;
     if (out_width > out_height)
     {
         size = out_height;
-        px = out_width / 2 - size / 2;
-        py = 0;
+        *px = out_width / 2 - size / 2;
+        *py = 0;
     }
     else
     {
         size = out_width;
-        px = 0;
-        py = out_height / 2 - size / 2;
+        *px = 0;
+        *py = out_height / 2 - size / 2;
     }
+    return size;
+}
 
+void render_single_out_image(NN nn, float a, Pool *pool)
+{
+    for (size_t i = 0; i < out_width * out_height; ++i)
+    {
+        out_pixels[i] = 0xFF000000;
+    }
+
+    size_t px, py;
+    size_t size = out_square(&px, &py);
     ROW_AT(NN_INPUT(nn), 2) = a;
-    gym_nn_image_grayscale(nn, &out_pixels[py * out_width + px], size, size, out_width, 0, 1);
+    gym_nn_image_grayscale_adaptive(nn, &out_pixels[py * out_width + px], size, size, out_width, 0, 1, out_tolerance, pool);
 }
 
-int render_upscaled_video(NN nn, float duration, const char *out_file_path)
+/* the image input of the given frame of the video, it goes 0 -> 1 -> 1 -> 0 */
+float video_frame_input(size_t frame, size_t frame_count)
+{
+    typedef struct
+    {
+        float start;
+        float end;
+    } Segment;
+
+    Segment segments[] = {
+        {0, 0},
+        {0, 1},
+        {1, 1},
+        {1, 0},
+    };
+    size_t segments_count = ARRAY_LEN(segments);
+    float segment_length = 1.0f / segments_count;
+
+    float a = ((float)frame) / frame_count;
+    size_t segment_index = floorf(a / segment_length);
+    float segment_progress = a / segment_length - segment_index;
+    if (segment_index >= segments_count)
+        segment_index = segments_count - 1;
+    Segment segment = segments[segment_index];
+    return segment.start + (segment.end - segment.start) * sqrtf(segment_progress);
+}
+
+typedef struct
+{
+    NN nn;
+    /* only the image input changes between the frames, so the separable part of the first layer is shared by all of them */
+    Gym_NN_Grid grid;
+    size_t frame_count;
+} Video;
+
+void render_video_frame(void *arg, size_t frame, void *pixels, Region *scratch)
+{
+    Video *video = arg;
+    gym_frame_clear(pixels, VIDEO_FORMAT, out_width, out_height);
+
+    Row input = row_alloc(scratch, NN_INPUT(video->nn).cols);
+    row_copy(input, NN_INPUT(video->nn));
+    ROW_AT(input, 2) = video_frame_input(frame, video->frame_count);
+
+    /* every frame is rendered by a single worker, the pool is busy with the other frames,
+       so the grid runs serially and allocates from the scratch of this worker */
+    size_t px, py;
+    out_square(&px, &py);
+    gym_nn_grid_render_format(&video->grid, video->nn, input, gym_frame_at(pixels, VIDEO_FORMAT, out_width, px, py), out_width, 0, 1, VIDEO_FORMAT, NULL);
+}
+
+/* renders the frames of the video in VIDEO_FORMAT and writes them into fd */
+bool render_video_frames(NN nn, float duration, int fd, Pool *pool)
+{
+    Video video = {
+        .nn = nn,
+        .frame_count = FPS * duration,
+    };
+    Region grid_region = region_alloc_growable(256 * 1024, 0);
+    size_t px, py;
+    size_t size = out_square(&px, &py);
+    gym_nn_grid_init(&grid_region, &video.grid, nn, size, size);
+
+    /* frames are rendered concurrently on the pool while the writer thread writes them in order */
+    bool ok = gym_render_frames(fd, video.frame_count, gym_frame_size(VIDEO_FORMAT, out_width, out_height), FRAMES_IN_FLIGHT, render_video_frame, &video, pool);
+
+    region_free(&grid_region);
+    return ok;
+}
+
+int render_upscaled_video(NN nn, float duration, const char *out_file_path, Pool *pool)
 {
     int pipefd[2];
 
@@ -106,7 +194,7 @@ int render_upscaled_video(NN nn, float duration, const char *out_file_path)
                          "-loglevel", "verbose",
                          "-y",
                          "-f", "rawvideo",
-                         "-pix_fmt", "rgba",
+                         "-pix_fmt", gym_pixel_format_name(VIDEO_FORMAT),
                          "-s", STR(out_width) "x" STR(out_height),
                          "-r", STR(FPS),
                          "-an",
@@ -124,46 +212,48 @@ int render_upscaled_video(NN nn, float duration, const char *out_file_path)
 
     close(pipefd[READ_END]);
 
-    typedef struct
-    {
-        float start;
-        float end;
-    } Segment;
-
-    Segment segments[] = {
-        {0, 0},
-        {0, 1},
-        {1, 1},
-        {1, 0},
-    };
-    size_t segments_count = ARRAY_LEN(segments);
-    float segment_length = 1.0f / segments_count;
+    bool ok = render_video_frames(nn, duration, pipefd[WRITE_END], pool);
 
-    size_t frame_count = FPS * duration;
+    close(pipefd[WRITE_END]);
+    wait(NULL);
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR: could not generate %s\n", out_file_path);
+        return 1;
+    }
+    printf("Generated %s!\n", out_file_path);
+    return 0;
+}
 
-    for (size_t i = 0; i < frame_count; ++i)
+/* dumps the raw frames into a file to be encoded later, no ffmpeg is needed while training */
+int render_upscaled_raw(NN nn, float duration, const char *out_file_path, Pool *pool)
+{
+    int fd = open(out_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        float a = ((float)i) / frame_count;
-        size_t segment_index = floorf(a / segment_length);
-        float segment_progress = a / segment_length - segment_index;
-        if (segment_index > segments_count)
-            segment_index = segment_length - 1;
-        Segment segment = segments[segment_index];
-        float b = segment.start + (segment.end - segment.start) * sqrtf(segment_progress);
-        render_single_out_image(nn, b);
-        write(pipefd[WRITE_END], out_pixels, sizeof(*out_pixels) * out_width * out_height);
-        printf("a = %f, index = %zu, progress = %f, b = %f\n", a, segment_index, segment_progress, b);
+        fprintf(stderr, "ERROR: could not open %s: %s\n", out_file_path, strerror(errno));
+        return 1;
     }
 
-    close(pipefd[WRITE_END]);
-    wait(NULL);
-    printf("Generated %s!\n", out_file_path);
+    bool ok = render_video_frames(nn, duration, fd, pool);
+    if (close(fd) < 0)
+    {
+        fprintf(stderr, "ERROR: could not close %s: %s\n", out_file_path, strerror(errno));
+        ok = false;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR: could not generate %s\n", out_file_path);
+        return 1;
+    }
+    printf("Generated %s! Encode it with:\n", out_file_path);
+    printf("    ffmpeg -f rawvideo -pix_fmt %s -s " STR(out_width) "x" STR(out_height) " -r " STR(FPS) " -i %s -c:v libx264 upscaled.mp4\n", gym_pixel_format_name(VIDEO_FORMAT), out_file_path);
     return 0;
 }
 
-int render_upscaled_screenshot(NN nn, const char *out_file_path)
+int render_upscaled_screenshot(NN nn, const char *out_file_path, Pool *pool)
 {
-    render_single_out_image(nn, scroll);
+    render_single_out_image(nn, scroll, pool);
 
     if (!stbi_write_png(out_file_path, out_width, out_height, 4, out_pixels, out_width * sizeof(*out_pixels)))
     {
@@ -243,72 +333,98 @@ Vector2 render_texture_in_slot(Texture2D texture, Gym_Horz_Align ha, Gym_Vert_Al
 }
 
 /* build training data int t for N images
-   prepare the training data from the data set:
+   every pixel of every image is a row of the data set:
        1st col: normalized x      feeds inout NN
        2nd col: normalized y      feeds inout NN
        3rd col: which image       feeds inout NN
        4th col: expected output   expected output, used for input for back prop
 
-       each row, pixels for each img, sorted as is in the originals
+   only the original u8 pixels are stored, the inputs are derived from the row
+   index when the batch is gathered. The pixels are referenced, not copied.
 */
-Mat build_training_data(NN nn, uint8_t **images_pxs, int *widths, int *heights, size_t img_count)
+Dataset build_training_data(NN nn, uint8_t **images_pxs, int *widths, int *heights, size_t img_count)
 {
-    size_t pixel_count = 0;
-    for (size_t i = 0; i < img_count; i++)
-    {
-        pixel_count += widths[i] * heights[i];
-    }
-
-    Mat t = mat_alloc(NULL, pixel_count, NN_INPUT(nn).cols + NN_OUTPUT(nn).cols);
-
-    size_t offset = 0;
-
-    /* fill info */
+    Dataset_Image images[img_count];
     for (size_t i = 0; i < img_count; i++)
     {
-        uint8_t *image_pxs = images_pxs[i];
-
-        for (int y = 0; y < heights[i]; ++y)
-        {
-            for (int x = 0; x < widths[i]; ++x)
-            {
-                size_t px_idx = y * widths[i] + x;
-                size_t mat_idx = offset + px_idx;
-                MAT_AT(t, mat_idx, 0) = (float)x / (widths[i] - 1);
-                MAT_AT(t, mat_idx, 1) = (float)y / (heights[i] - 1);
-                MAT_AT(t, mat_idx, 2) = (float)i;
-                MAT_AT(t, mat_idx, 3) = image_pxs[px_idx] / 255.f;
-            }
-        }
-
-        offset += widths[i] * heights[i];
+        images[i].pixels = images_pxs[i];
+        images[i].width = widths[i];
+        images[i].height = heights[i];
     }
 
+    Dataset t = dataset_from_image_coords(NULL, images, img_count);
+    NN_ASSERT(t.cols == NN_INPUT(nn).cols + NN_OUTPUT(nn).cols);
     return t;
 }
 
 void print_usage(const char *program)
 {
-    fprintf(stderr, "Usage: %s <image1> <image2> <image3> ...\n", program);
+    fprintf(stderr, "Usage: %s <image1|dir1> <image2|dir2> <image3|dir3> ...\n", program);
     fprintf(stderr, "       at least 2 images are required\n");
+    fprintf(stderr, "       every png in the label subdirectories of a directory is used,\n");
+    fprintf(stderr, "       the decoded images are cached in <dir>.cache\n");
 }
 
 int main(int argc, char **argv)
 {
-    Region temp = region_alloc_alloc(256 * 1024 * 1024);
+    Region temp = region_alloc_growable(1024*1024, 0);
+    alloc_trace_region_name(&temp, "temp");
 
     const char *program = args_shift(&argc, &argv);
 
-    if (argc < 2)
+    if (argc < 1)
     {
         fprintf(stderr, "ERROR: no image is provided\n");
         print_usage(program);
         return 1;
     }
 
-    int i = 0;
+    Pool pool;
+    if (!pool_init(&pool, 0))
+    {
+        return 1;
+    }
+
+    /* directories are decoded in parallel as a whole image set */
+    int args_count = argc;
+    Image_Set sets[args_count];
+    bool is_dir[args_count];
+    size_t img_count = 0;
+
+    for (int j = 0; j < args_count; j++)
+    {
+        struct stat st;
+        is_dir[j] = stat(argv[j], &st) == 0 && S_ISDIR(st.st_mode);
+        if (is_dir[j])
+        {
+            char cache_path[PATH_MAX];
+            int n = strlen(argv[j]);
+            while (n > 1 && argv[j][n - 1] == '/')
+                n--;
+            snprintf(cache_path, sizeof(cache_path), "%.*s.cache", n, argv[j]);
+
+            if (!image_set_load_dir(NULL, &sets[j], argv[j], cache_path, &pool))
+            {
+                return 1;
+            }
+            printf("%s: %zu images of size %zux%zu in %zu labels\n", argv[j], sets[j].count, sets[j].width, sets[j].height, sets[j].label_count);
+            img_count += sets[j].count;
+        }
+        else
+        {
+            img_count += 1;
+        }
+    }
+
+    if (img_count < 2)
+    {
+        fprintf(stderr, "ERROR: only %zu image is provided\n", img_count);
+        print_usage(program);
+        return 1;
+    }
+
+    size_t i = 0;
 
-    size_t img_count = argc;
     uint8_t *img_pixels[img_count];
     int img_width[img_count];
     int img_height[img_count];
@@ -318,9 +434,23 @@ int main(int argc, char **argv)
     getcwd(cwd, sizeof(cwd));
     printf("Current path: %s\n", cwd);
 
-    while (argc > 0)
+    for (int j = 0; j < args_count; j++)
     {
         const char *img_file_path = args_shift(&argc, &argv);
+
+        if (is_dir[j])
+        {
+            for (size_t k = 0; k < sets[j].count; k++)
+            {
+                img_pixels[i] = IMAGE_SET_AT(sets[j], k);
+                img_width[i] = sets[j].width;
+                img_height[i] = sets[j].height;
+                img_comp[i] = 1;
+                i++;
+            }
+            continue;
+        }
+
         img_pixels[i] = (uint8_t *)stbi_load(img_file_path, &img_width[i], &img_height[i], &img_comp[i], 0);
         printf("Image: %s\n", img_file_path);
 
@@ -341,10 +471,13 @@ int main(int argc, char **argv)
         i++;
     }
 
+    /* only the first images get a preview, there can be thousands of them in a directory */
+    size_t preview_count = img_count < max_previews ? img_count : max_previews;
+
     NN nn = nn_alloc(NULL, arch, ARRAY_LEN(arch)); // instances the NN
     nn_rand(nn, -1, 1);                            // fill nn with random values
 
-    Mat t = build_training_data(nn, img_pixels, img_width, img_height, img_count);
+    Dataset t = build_training_data(nn, img_pixels, img_width, img_height, img_count);
 
     size_t preview_width = 28;
     size_t preview_height = 28;
@@ -354,30 +487,28 @@ int main(int argc, char **argv)
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "gym");
-    SetTargetFPS(60);
+    Gym_Frame_Budget frame;
+    gym_frame_budget_init(&frame);
 
     Gym_Plot plot = {0};
     Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
 
-    Image preview_image[img_count];
-    Texture2D preview_texture[img_count];
+    Gym_NN_Preview preview[preview_count];
 
     /* generates previews with all black pixels*/
-    for (int i = 0; i < img_count; i++)
+    for (size_t i = 0; i < preview_count; i++)
     {
-        preview_image[i] = GenImageColor(preview_width, preview_height, BLACK);
-        preview_texture[i] = LoadTextureFromImage(preview_image[i]);
+        preview[i] = gym_nn_preview_load(preview_width, preview_height);
     }
 
-    Image preview_scrolled = GenImageColor(preview_width, preview_height, BLACK);
-    Texture2D preview_texture3 = LoadTextureFromImage(preview_scrolled);
+    Gym_NN_Preview preview_scrolled = gym_nn_preview_load(preview_width, preview_height);
 
-    Image original_image[img_count];
-    Texture2D oiginal_texture[img_count];
+    Image original_image[preview_count];
+    Texture2D oiginal_texture[preview_count];
 
     /* previews for the original images */
-    for (int i = 0; i < img_count; i++)
+    for (size_t i = 0; i < preview_count; i++)
     {
         original_image[i] = GenImageColor(img_width[i], img_height[i], GRAY);
         for (size_t y = 0; y < (size_t)img_height[i]; ++y)
@@ -397,12 +528,23 @@ int main(int argc, char **argv)
     bool scroll_dragging = false;
     size_t epoch = 0;
 
+    if (access(CHECKPOINT_FILE_PATH, F_OK) == 0 && checkpoint_load(nn, &t, &batch, &epoch, CHECKPOINT_FILE_PATH))
+    {
+        printf("Resumed from %s at epoch %zu\n", CHECKPOINT_FILE_PATH, epoch);
+    }
+
+    Checkpoint checkpoint;
+    if (!checkpoint_begin(&checkpoint, nn, CHECKPOINT_FILE_PATH, 10))
+    {
+        return 1;
+    }
+
     int w = GetRenderWidth();
     int h = GetRenderHeight();
 
     /*images/preview space: will be matrix of NxN deendin on the number of the input images */
-    int n_samples_x = ceil(sqrt(img_count));
-    int n_samples_y = ceil(img_count / (float)n_samples_x);
+    int n_samples_x = ceil(sqrt(preview_count));
+    int n_samples_y = ceil(preview_count / (float)n_samples_x);
 
     bool original_imgs_already_rendered = false;
 
@@ -421,8 +563,8 @@ int main(int argc, char **argv)
     Gym_Rect images_slot;
     Gym_Rect preview_slot;
     Gym_Rect preview_slide_slot;
-    Gym_Rect images_sub_slot[img_count];
-    Gym_Rect previews_sub_slot[img_count];
+    Gym_Rect images_sub_slot[preview_count];
+    Gym_Rect previews_sub_slot[preview_count];
 
     gym_layout_begin(GLO_HORZ, r, 3, 10);
     {
@@ -445,7 +587,7 @@ int main(int argc, char **argv)
 
                     gym_layout_begin(GLO_HORZ, row_slot, n_samples_x, 0);
                     {
-                        for (int i = 0; i < n_samples_x && global_i < img_count; i++)
+                        for (int i = 0; i < n_samples_x && global_i < preview_count; i++)
                         {
                             images_sub_slot[global_i] = gym_layout_slot();
                             global_i++;
@@ -454,7 +596,7 @@ int main(int argc, char **argv)
                     gym_layout_end();
                 }
                 /* purge the non used laouts */
-                for (int j = 0; j < img_count - global_i; j++)
+                for (size_t j = 0; j < preview_count - global_i; j++)
                 {
                     gym_layout_slot();
                 }
@@ -471,7 +613,7 @@ int main(int argc, char **argv)
 
                     gym_layout_begin(GLO_HORZ, row_slot, n_samples_x, 0);
                     {
-                        for (int i = 0; i < n_samples_x && global_i < img_count; i++)
+                        for (int i = 0; i < n_samples_x && global_i < preview_count; i++)
                         {
                             previews_sub_slot[global_i] = gym_layout_slot();
                             global_i++;
@@ -480,7 +622,7 @@ int main(int argc, char **argv)
                     gym_layout_end();
                 }
                 /* purge the non used laouts */
-                for (int j = 0; j < img_count - global_i; j++)
+                for (size_t j = 0; j < preview_count - global_i; j++)
                 {
                     gym_layout_slot();
                 }
@@ -501,47 +643,66 @@ int main(int argc, char **argv)
         {
             epoch = 0;
             nn_rand(nn, -1, 1);
-            plot.count = 0;
+            gym_plot_reset(&plot);
         }
         if (IsKeyPressed(KEY_S))
         {
-            render_upscaled_screenshot(nn, "upscaled.png");
+            render_upscaled_screenshot(nn, "upscaled.png", &pool);
         }
         if (IsKeyPressed(KEY_X))
         {
-            render_upscaled_video(nn, 5, "upscaled.mp4");
+            render_upscaled_video(nn, 5, "upscaled.mp4", &pool);
+        }
+        if (IsKeyPressed(KEY_V))
+        {
+            render_upscaled_raw(nn, 5, "upscaled.yuv", &pool);
         }
         if (IsKeyPressed(KEY_P))
         {
             nn_print(nn, "nice");
         }
+        if (IsKeyPressed(KEY_M))
+        {
+            if (nn_save(nn, "img2nn.nn"))
+            {
+                printf("Generated img2nn.nn\n");
+            }
+        }
 
-        for (size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i)
+        /* trains for whatever is left of the frame after drawing the previous one */
+        Train_Budget *train = gym_frame_train(&frame);
+        while (!paused && epoch < max_epoch && train_budget_next(train))
         {
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
+            size_t s = region_save(&temp);
+            dataset_batch_process(&temp, &batch, batch_size, nn, t, rate);
+            region_rewind(&temp, s);
+            alloc_trace_step();
 
             if (batch.finished)
             {
                 epoch += 1;
-                da_append(&plot, batch.cost);
-                mat_shuffle_rows(t);
+                gym_plot_push(&plot, batch.cost);
+                dataset_shuffle(&t);
+                if (epoch % checkpoint_every == 0)
+                {
+                    checkpoint_save(&checkpoint, nn, t, batch, epoch);
+                }
             }
         }
+        gym_frame_draw(&frame);
 
         /* exites the NN or each input and generat the previed for them.*/
-        for (int i = 0; i < img_count; i++)
+        for (size_t i = 0; i < preview_count; i++)
         {
             ROW_AT(NN_INPUT(nn), 2) = i;
-            gym_nn_image_grayscale(nn, preview_image[i].data, preview_image[i].width, preview_image[i].height, preview_image[i].width, 0, 1);
-            UpdateTexture(preview_texture[i], preview_image[i].data);
+            gym_nn_preview_update(&preview[i], nn, &pool);
         }
 
         /* generates the preview for the scrolled input */
         ROW_AT(NN_INPUT(nn), 2) = scroll * (img_count - 1);
-        gym_nn_image_grayscale(nn, preview_scrolled.data, preview_scrolled.width, preview_scrolled.height, preview_scrolled.width, 0, 1);
-        UpdateTexture(preview_texture3, preview_scrolled.data);
+        gym_nn_preview_update(&preview_scrolled, nn, &pool);
 
-        BeginDrawing();
+        gym_begin_drawing();
         ClearBackground(GYM_BACKGROUND);
         {
             gym_plot(plot, gym_plot_slot, RED);
@@ -553,7 +714,7 @@ int main(int argc, char **argv)
             // if (!original_imgs_already_rendered)
             {
                 /* input images slots */
-                for (int i = 0; i < img_count; i++)
+                for (size_t i = 0; i < preview_count; i++)
                 {
                     render_texture_in_slot(oiginal_texture[i], GHA_CENTER, GVA_CENTER, images_sub_slot[i]);
                 }
@@ -562,12 +723,12 @@ int main(int argc, char **argv)
             }
 
             /* preview  images slots */
-            for (int i = 0; i < img_count; i++)
+            for (size_t i = 0; i < preview_count; i++)
             {
-                render_texture_in_slot(preview_texture[i], GHA_CENTER, GVA_CENTER, previews_sub_slot[i]);
+                render_texture_in_slot(preview[i].texture, GHA_CENTER, GVA_CENTER, previews_sub_slot[i]);
             }
 
-            render_texture_in_slot(preview_texture3, GHA_CENTER, GVA_CENTER, preview_slide_slot);
+            render_texture_in_slot(preview_scrolled.texture, GHA_CENTER, GVA_CENTER, preview_slide_slot);
             {
                 float rw = master_peview_slot.w;
                 float rh = master_peview_slot.h * 0.03;
@@ -577,14 +738,20 @@ int main(int argc, char **argv)
             }
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, plot.count > 0 ? plot.items[plot.count - 1] : 0, region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, gym_plot_last(plot), region_occupied_bytes(&temp));
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h * 0.04, 0, WHITE);
             gym_slider(&rate, &rate_dragging, 0, h * 0.08, w, h * 0.02);
         }
-        EndDrawing();
+        gym_end_drawing();
+        gym_frame_end(&frame);
 
         region_reset(&temp);
     }
 
+    checkpoint_end(&checkpoint);
+    pool_free(&pool);
+    pool_scratch_release();
+    alloc_trace_report(stdout);
+
     return 0;
 }
@@ -28,7 +28,6 @@ enum {
 
 size_t arch[] = {WIDTH*HEIGHT, 14, 7, 5, SHAPES};
 size_t batch_size = 20;
-size_t batches_per_frame = 20;
 float rate = 0.1f;
 bool paused = true;
 
@@ -75,11 +74,26 @@ void canvas_to_row(Row row, Olivec_Canvas oc)
     }
 }
 
-Mat generate_samples(Region *r, size_t samples)
+// Pixels and one hot outputs are stored as u8, the gather scales them to floats
+void canvas_to_dataset(Dataset t, size_t row, Olivec_Canvas oc)
+{
+    uint8_t *pixels = dataset_at(t, row, 0);
+    for (size_t y = 0; y < oc.height; ++y){
+        for (size_t x = 0; x < oc.width; ++x) {
+            pixels[y*oc.width + x] = OLIVEC_PIXEL(oc, x, y)&0xFF;
+        }
+    }
+}
+
+Dataset generate_samples(Region *r, size_t samples)
 {
     size_t input_size = WIDTH*HEIGHT;
     size_t output_size = SHAPES;
-    Mat t = mat_alloc(r, samples*SHAPES, input_size + output_size);
+    Dataset_Column columns[] = {
+        {COLUMN_U8, input_size, 1.f/255.f, 0.f},
+        {COLUMN_U8, output_size, 1.f, 0.f},
+    };
+    Dataset t = dataset_alloc_columns(r, samples*SHAPES, columns, ARRAY_LEN(columns));
     size_t s = region_save(r);
         Olivec_Canvas oc = {0};
         oc.pixels = region_alloc(r, WIDTH*HEIGHT*sizeof(*oc.pixels));
@@ -91,18 +105,17 @@ Mat generate_samples(Region *r, size_t samples)
             random_boundary(oc.width, oc.height, &x, &y, &w, &h);
             int r = (w < h ? w : h)/2;
             for (size_t j = 0; j < SHAPES; ++j) {
-                Row row = mat_row(t, i*2 + j);
-                Row in = row_slice(row, 0, input_size);
-                Row out = row_slice(row, input_size, output_size);
+                size_t row = i*2 + j;
                 olivec_fill(oc, BACKGROUND_COLOR);
                 switch (j) {
                 case SHAPE_CIRCLE: olivec_circle(oc, x + w/2, y + h/2, r, FOREGROUND_COLOR); break;
                 case SHAPE_RECT:   olivec_rect(oc, x, y, w, h, FOREGROUND_COLOR);  break;
                 default: assert(0 && "unreachable");
                 }
-                canvas_to_row(in, oc);
-                row_fill(out, 0);
-                ROW_AT(out, j) = 1.0f;
+                canvas_to_dataset(t, row, oc);
+                uint8_t *out = dataset_at(t, row, input_size);
+                memset(out, 0, output_size);
+                out[j] = 1;
             }
         }
     region_rewind(r, s);
@@ -141,10 +154,11 @@ void gym_drawable_canvas(Olivec_Canvas oc, Gym_Rect r)
     }
 }
 
-void display_training_data(Mat t)
+void display_training_data(Region *r, Dataset t)
 {
     for (size_t i = 0; i < t.rows; ++i) {
-        Row row = mat_row(t, i);
+        size_t s = region_save(r);
+        Row row = mat_row(dataset_gather(r, t, i, 1), 0);
         Row in = row_slice(row, 0, WIDTH*HEIGHT);
         Row out = row_slice(row, WIDTH*HEIGHT, SHAPES);
         for (size_t y = 0; y < HEIGHT; ++y) {
@@ -158,20 +172,22 @@ void display_training_data(Mat t)
             printf("\n");
         }
         MAT_PRINT(row_as_mat(out));
+        region_rewind(r, s);
     }
 }
 
 int main(void)
 {
     srand(time(0));
+    rand_seed(time(0));
 
-    Region temp = region_alloc_alloc(256*1024*1024);
-    Region main = region_alloc_alloc(256*1024*1024);
+    Region temp = region_alloc_growable(1024*1024, 0);
+    Region main = region_alloc_growable(1024*1024, 0);
 
     NN nn = nn_alloc(&main, arch, ARRAY_LEN(arch));
     nn_rand(nn, -1, 1);
-    Mat t = generate_samples(&main, TRAINING_SAMPLES_PER_SHAPE);
-    Mat v = generate_samples(&main, VERIFICATION_SAMPLES_PER_SHAPE);
+    Dataset t = generate_samples(&main, TRAINING_SAMPLES_PER_SHAPE);
+    Dataset v = generate_samples(&main, VERIFICATION_SAMPLES_PER_SHAPE);
 
     Gym_Plot tplot = {0};
     Gym_Plot vplot = {0};
@@ -180,7 +196,8 @@ int main(void)
     int factor = 80;
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(16*factor, 9*factor, "Shape");
-    SetTargetFPS(60);
+    Gym_Frame_Budget frame;
+    gym_frame_budget_init(&frame);
 
     Olivec_Canvas canvas = {0};
     canvas.pixels = region_alloc(&main, WIDTH*HEIGHT*sizeof(*canvas.pixels));
@@ -195,8 +212,8 @@ int main(void)
         }
         if (IsKeyPressed(KEY_R)) {
             nn_rand(nn, -1, 1);
-            tplot.count = 0;
-            vplot.count = 0;
+            gym_plot_reset(&tplot);
+            gym_plot_reset(&vplot);
         }
         if (IsKeyPressed(KEY_C)) {
             olivec_fill(canvas, BACKGROUND_COLOR);
@@ -208,18 +225,20 @@ int main(void)
             random_rect(canvas);
         }
 
-        for (size_t i = 0; i < batches_per_frame && !paused; ++i) {
+        Train_Budget *train = gym_frame_train(&frame);
+        while (!paused && train_budget_next(train)) {
             size_t s = region_save(&temp);
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
+            dataset_batch_process(&temp, &batch, batch_size, nn, t, rate);
             if (batch.finished) {
-                da_append(&tplot, batch.cost);
-                mat_shuffle_rows(t);
-                da_append(&vplot, nn_cost(nn, v));
+                gym_plot_push(&tplot, batch.cost);
+                dataset_shuffle(&t);
+                gym_plot_push(&vplot, dataset_cost(&temp, nn, v));
             }
             region_rewind(&temp, s);
         }
+        gym_frame_draw(&frame);
 
-        BeginDrawing();
+        gym_begin_drawing();
             ClearBackground(GYM_BACKGROUND);
             gym_layout_begin(GLO_HORZ, gym_root(), 2, 10);
                 gym_layout_begin(GLO_VERT, gym_layout_slot(), 2, 10);
@@ -241,7 +260,8 @@ int main(void)
                     }
                 gym_layout_end();
             gym_layout_end();
-        EndDrawing();
+        gym_end_drawing();
+        gym_frame_end(&frame);
     }
 
     CloseWindow();
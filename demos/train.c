@@ -0,0 +1,413 @@
+// Headless trainer. Trains a model on a dataset at full speed without raylib
+// or a window, so it can run on a server. Only depends on nn.h and stb_image.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+#define ARCH_CAP 32
+// How often the stats and the parameters go to the monitor
+#define MONITOR_PUBLISH_SECS 0.1
+
+typedef struct {
+    const char *dataset_path;
+    const char *labels_path;
+    const char *model_path;
+    const char *checkpoint_path;
+    const char *monitor_name;
+    size_t hidden[ARCH_CAP];
+    size_t hidden_count;
+    bool coords;
+    size_t epochs;
+    size_t batch_size;
+    float rate;
+    uint64_t seed;
+    size_t log_every;
+    size_t checkpoint_every;
+    size_t workers;
+} Options;
+
+volatile sig_atomic_t interrupted = 0;
+
+void handle_interrupt(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+char *args_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    char *result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] <dataset>\n", program);
+    fprintf(stderr, "  <dataset>     directory of pngs in label subdirectories, image set file or MNIST idx images file\n");
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "  -l <path>     MNIST idx labels file of an idx dataset\n");
+    fprintf(stderr, "  -a <arch>     comma separated sizes of the hidden layers (default: 28,28,9).\n");
+    fprintf(stderr, "                The input and output layers are defined by the dataset\n");
+    fprintf(stderr, "  -coords       learn (x, y, image) -> pixel of every image like img2nn does\n");
+    fprintf(stderr, "                instead of classifying the images by their labels\n");
+    fprintf(stderr, "  -e <count>    epochs to train (default: 100)\n");
+    fprintf(stderr, "  -b <size>     batch size (default: 28)\n");
+    fprintf(stderr, "  -r <rate>     learning rate of the gradient descent (default: 1.0)\n");
+    fprintf(stderr, "  -s <seed>     seed of the initial parameters and the shuffling (default: time)\n");
+    fprintf(stderr, "  -o <path>     output model file (default: model.nn)\n");
+    fprintf(stderr, "  -c <path>     checkpoint file, resumed from if it exists (default: <output>.ckpt)\n");
+    fprintf(stderr, "  -ce <count>   checkpoint every <count> epochs, 0 disables checkpoints (default: 10)\n");
+    fprintf(stderr, "  -le <count>   log every <count> epochs (default: 1)\n");
+    fprintf(stderr, "  -j <count>    threads decoding the images, 0 - one per CPU (default: 0)\n");
+    fprintf(stderr, "  -m <name>     publish the progress into the shared memory <name> (e.g. /nn) for viewers\n");
+}
+
+bool parse_size(const char *program, const char *flag, const char *s, size_t *result)
+{
+    char *end;
+    errno = 0;
+    unsigned long long x = strtoull(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || *s == '-') {
+        fprintf(stderr, "ERROR: %s expects a non-negative integer, got %s\n", flag, s);
+        print_usage(program);
+        return false;
+    }
+    *result = x;
+    return true;
+}
+
+bool parse_arch(const char *program, const char *s, Options *opts)
+{
+    opts->hidden_count = 0;
+    while (*s != '\0') {
+        char *end;
+        unsigned long long x = strtoull(s, &end, 10);
+        if (end == s || x == 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "ERROR: invalid arch %s\n", s);
+            print_usage(program);
+            return false;
+        }
+        if (opts->hidden_count + 2 >= ARCH_CAP) {
+            fprintf(stderr, "ERROR: too many layers, at most %d are supported\n", ARCH_CAP);
+            return false;
+        }
+        opts->hidden[opts->hidden_count++] = x;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+bool parse_options(int argc, char **argv, Options *opts)
+{
+    const char *program = args_shift(&argc, &argv);
+
+    while (argc > 0) {
+        const char *flag = args_shift(&argc, &argv);
+        if (flag[0] != '-') {
+            if (opts->dataset_path != NULL) {
+                fprintf(stderr, "ERROR: only one dataset is supported\n");
+                print_usage(program);
+                return false;
+            }
+            opts->dataset_path = flag;
+            continue;
+        }
+
+        if (strcmp(flag, "-h") == 0) {
+            print_usage(program);
+            exit(0);
+        }
+
+        if (strcmp(flag, "-coords") == 0) {
+            opts->coords = true;
+            continue;
+        }
+
+        if (argc <= 0) {
+            fprintf(stderr, "ERROR: no value is provided for %s\n", flag);
+            print_usage(program);
+            return false;
+        }
+        const char *value = args_shift(&argc, &argv);
+
+        if (strcmp(flag, "-l") == 0) {
+            opts->labels_path = value;
+        } else if (strcmp(flag, "-a") == 0) {
+            if (!parse_arch(program, value, opts)) return false;
+        } else if (strcmp(flag, "-e") == 0) {
+            if (!parse_size(program, flag, value, &opts->epochs)) return false;
+        } else if (strcmp(flag, "-b") == 0) {
+            if (!parse_size(program, flag, value, &opts->batch_size)) return false;
+            if (opts->batch_size == 0) {
+                fprintf(stderr, "ERROR: batch size must be positive\n");
+                return false;
+            }
+        } else if (strcmp(flag, "-r") == 0) {
+            char *end;
+            opts->rate = strtof(value, &end);
+            if (end == value || *end != '\0') {
+                fprintf(stderr, "ERROR: %s expects a number, got %s\n", flag, value);
+                print_usage(program);
+                return false;
+            }
+        } else if (strcmp(flag, "-s") == 0) {
+            size_t seed;
+            if (!parse_size(program, flag, value, &seed)) return false;
+            opts->seed = seed;
+        } else if (strcmp(flag, "-o") == 0) {
+            opts->model_path = value;
+        } else if (strcmp(flag, "-c") == 0) {
+            opts->checkpoint_path = value;
+        } else if (strcmp(flag, "-ce") == 0) {
+            if (!parse_size(program, flag, value, &opts->checkpoint_every)) return false;
+        } else if (strcmp(flag, "-le") == 0) {
+            if (!parse_size(program, flag, value, &opts->log_every)) return false;
+        } else if (strcmp(flag, "-m") == 0) {
+            opts->monitor_name = value;
+        } else if (strcmp(flag, "-j") == 0) {
+            if (!parse_size(program, flag, value, &opts->workers)) return false;
+        } else {
+            fprintf(stderr, "ERROR: unknown flag %s\n", flag);
+            print_usage(program);
+            return false;
+        }
+    }
+
+    if (opts->dataset_path == NULL) {
+        fprintf(stderr, "ERROR: no dataset is provided\n");
+        print_usage(program);
+        return false;
+    }
+    return true;
+}
+
+// Directories are decoded and cached in <dir>.cache, image set files start
+// with IMAGE_SET_MAGIC and everything else is expected to be an idx file
+bool load_images(Image_Set *set, const Options *opts, Pool *pool)
+{
+    struct stat st;
+    if (stat(opts->dataset_path, &st) < 0) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", opts->dataset_path, strerror(errno));
+        return false;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        char cache_path[PATH_MAX];
+        int n = strlen(opts->dataset_path);
+        while (n > 1 && opts->dataset_path[n - 1] == '/') n--;
+        snprintf(cache_path, sizeof(cache_path), "%.*s.cache", n, opts->dataset_path);
+        return image_set_load_dir(NULL, set, opts->dataset_path, cache_path, pool);
+    }
+
+    char magic[4] = {0};
+    FILE *f = fopen(opts->dataset_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", opts->dataset_path, strerror(errno));
+        return false;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+
+    if (n == sizeof(magic) && memcmp(magic, IMAGE_SET_MAGIC, sizeof(magic)) == 0) {
+        return image_set_load(NULL, set, opts->dataset_path);
+    }
+    return image_set_load_idx(NULL, set, opts->dataset_path, opts->labels_path);
+}
+
+double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    Options opts = {
+        .model_path = "model.nn",
+        .hidden = {28, 28, 9},
+        .hidden_count = 3,
+        .epochs = 100,
+        .batch_size = 28,
+        .rate = 1.0f,
+        .seed = time(0),
+        .log_every = 1,
+        .checkpoint_every = 10,
+    };
+    if (!parse_options(argc, argv, &opts)) return 1;
+
+    char checkpoint_path[PATH_MAX];
+    if (opts.checkpoint_path == NULL) {
+        snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.ckpt", opts.model_path);
+        opts.checkpoint_path = checkpoint_path;
+    }
+
+    Pool pool;
+    if (!pool_init(&pool, opts.workers)) return 1;
+
+    Image_Set set = {0};
+    if (!load_images(&set, &opts, &pool)) return 1;
+    printf("%s: %zu images of size %zux%zu in %zu labels\n", opts.dataset_path, set.count, set.width, set.height, set.label_count);
+
+    // The workers are only needed for decoding
+    pool_free(&pool);
+
+    Dataset t;
+    if (opts.coords) {
+        Dataset_Image *images = malloc(sizeof(*images)*set.count);
+        assert(images != NULL);
+        for (size_t i = 0; i < set.count; ++i) {
+            images[i].pixels = IMAGE_SET_AT(set, i);
+            images[i].width = set.width;
+            images[i].height = set.height;
+        }
+        t = dataset_from_image_coords(NULL, images, set.count);
+        free(images);
+    } else {
+        if (set.label_count < 2) {
+            fprintf(stderr, "ERROR: %s has %zu labels, classification needs at least 2 (or use -coords)\n", opts.dataset_path, set.label_count);
+            return 1;
+        }
+        t = dataset_from_image_set(set);
+    }
+
+    size_t outputs = opts.coords ? 1 : set.label_count;
+    size_t arch[ARCH_CAP];
+    size_t arch_count = 0;
+    arch[arch_count++] = t.cols - outputs;
+    for (size_t i = 0; i < opts.hidden_count; ++i) arch[arch_count++] = opts.hidden[i];
+    arch[arch_count++] = outputs;
+
+    printf("arch:");
+    for (size_t i = 0; i < arch_count; ++i) printf(" %zu", arch[i]);
+    printf(", %zu samples, batch size %zu, rate %f, seed %llu\n", t.rows, opts.batch_size, opts.rate, (unsigned long long) opts.seed);
+
+    rand_seed(opts.seed);
+    NN nn = nn_alloc(NULL, arch, arch_count);
+    nn_rand(nn, -1, 1);
+
+    Batch batch = {0};
+    size_t epoch = 0;
+    if (access(opts.checkpoint_path, F_OK) == 0) {
+        if (!checkpoint_load(nn, &t, &batch, &epoch, opts.checkpoint_path)) return 1;
+        printf("Resumed from %s at epoch %zu\n", opts.checkpoint_path, epoch);
+    }
+
+    Checkpoint checkpoint;
+    if (opts.checkpoint_every > 0 && !checkpoint_begin(&checkpoint, nn, opts.checkpoint_path, 10)) return 1;
+
+    Monitor monitor = {0};
+    if (opts.monitor_name != NULL) {
+        if (!monitor_create(&monitor, opts.monitor_name, nn)) return 1;
+        monitor_publish_params(&monitor, nn);
+        printf("Publishing the progress into %s\n", opts.monitor_name);
+    }
+
+    signal(SIGINT, handle_interrupt);
+    signal(SIGTERM, handle_interrupt);
+
+    Region temp = region_alloc_growable(1024*1024, 0);
+    double start = now_secs();
+    double log_start = start;
+    size_t log_samples = 0;
+    double publish_start = start;
+    size_t publish_samples = 0;
+    size_t samples = 0;
+    float cost = 0;
+
+    while (epoch < opts.epochs && !interrupted) {
+        size_t begin = batch.finished ? 0 : batch.begin;
+        size_t mark = region_save(&temp);
+        dataset_batch_process(&temp, &batch, opts.batch_size, nn, t, opts.rate);
+        region_rewind(&temp, mark);
+        size_t processed = (batch.finished ? t.rows : batch.begin) - begin;
+        log_samples += processed;
+        publish_samples += processed;
+        samples += processed;
+
+        if (batch.finished) {
+            epoch += 1;
+            dataset_shuffle(&t);
+            cost = batch.cost;
+            if (monitor.header != NULL) monitor_push_cost(&monitor, cost);
+        }
+
+        if (monitor.header != NULL) {
+            double now = now_secs();
+            if (now - publish_start >= MONITOR_PUBLISH_SECS) {
+                Monitor_Stats stats = {
+                    .epoch = epoch,
+                    .samples = samples,
+                    .rate = opts.rate,
+                    .samples_per_sec = publish_samples/(now - publish_start),
+                    .cost = cost,
+                };
+                monitor_publish_stats(&monitor, stats);
+                monitor_publish_params(&monitor, nn);
+                publish_start = now;
+                publish_samples = 0;
+            }
+        }
+
+        if (!batch.finished) continue;
+
+        if (opts.log_every > 0 && (epoch % opts.log_every == 0 || epoch == opts.epochs)) {
+            double now = now_secs();
+            printf("epoch %zu/%zu: cost %f, %.0f samples/s, %.1fs elapsed\n",
+                   epoch, opts.epochs, batch.cost, log_samples/(now - log_start), now - start);
+            fflush(stdout);
+            log_start = now;
+            log_samples = 0;
+        }
+
+        if (opts.checkpoint_every > 0 && epoch % opts.checkpoint_every == 0) {
+            checkpoint_save(&checkpoint, nn, t, batch, epoch);
+        }
+    }
+
+    if (interrupted) printf("Interrupted at epoch %zu\n", epoch);
+
+    int result = 0;
+    if (opts.checkpoint_every > 0) {
+        // The final state goes into the checkpoint too, so an interrupted
+        // training resumes from where it stopped
+        while (!checkpoint_save(&checkpoint, nn, t, batch, epoch)) usleep(1000);
+        checkpoint_end(&checkpoint);
+    }
+    if (nn_save(nn, opts.model_path)) {
+        printf("Saved %s\n", opts.model_path);
+    } else {
+        result = 1;
+    }
+
+    if (monitor.header != NULL) {
+        Monitor_Stats stats = {
+            .epoch = epoch,
+            .samples = samples,
+            .rate = opts.rate,
+            .cost = cost,
+        };
+        monitor_publish_stats(&monitor, stats);
+        monitor_publish_params(&monitor, nn);
+        monitor_close(&monitor);
+    }
+    region_free(&temp);
+    return result;
+}
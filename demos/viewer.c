@@ -0,0 +1,125 @@
+// Dashboard of a training running in another process, see demos/train.c -m.
+// Attaches to the monitor read-only, so any number of viewers can come and
+// go without slowing the training down.
+#include <assert.h>
+#include <stdio.h>
+
+#define GYM_IMPLEMENTATION
+#include "gym.h"
+
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+// How often the viewer checks whether the trainer is gone or restarted
+#define REATTACH_SECS 1.0
+
+char *args_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    char *result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    args_shift(&argc, &argv);
+    const char *name = argc > 0 ? args_shift(&argc, &argv) : "/nn";
+
+    size_t WINDOW_FACTOR = 80;
+    size_t WINDOW_WIDTH = (16*WINDOW_FACTOR);
+    size_t WINDOW_HEIGHT = (9*WINDOW_FACTOR);
+
+    SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+    InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "viewer");
+    gym_set_target_fps(60);
+
+    Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
+    SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
+
+    // Everything that depends on the arch of the trainer lives here and is
+    // thrown away when the viewer attaches again
+    Region attached = region_alloc_growable(1024*1024, 0);
+    Monitor monitor = {0};
+    NN nn = {0};
+    uint64_t version = 0;
+    Monitor_Stats stats = {0};
+    float *history = NULL;
+    size_t history_count = 0;
+    size_t plotted = 0; // costs of the trainer already pushed into plot
+    Gym_Plot plot = {0};
+    double checked = -REATTACH_SECS;
+    bool stale = true;
+
+    while (!WindowShouldClose()) {
+        double now = GetTime();
+        if (now - checked >= REATTACH_SECS) {
+            checked = now;
+            // The last snapshot of a finished training stays on the screen
+            // until another trainer shows up
+            stale = monitor_stale(&monitor);
+            Monitor fresh;
+            if (stale && monitor_attach(&fresh, name)) {
+                monitor_close(&monitor);
+                monitor = fresh;
+                stale = false;
+                region_reset(&attached);
+                nn = monitor_nn_alloc(&attached, &monitor);
+                version = 0;
+                history = region_alloc(&attached, sizeof(*history)*monitor.header->history_cap);
+                assert(history != NULL);
+                plotted = 0;
+                gym_plot_reset(&plot);
+            }
+        }
+
+        if (monitor.header != NULL) {
+            // Only the costs pushed since the last frame are copied, the ring
+            // may already have dropped some of them
+            if (monitor_read_stats(&monitor, &stats, plotted, history, &history_count)) {
+                for (size_t i = 0; i < history_count; ++i) {
+                    gym_plot_push(&plot, history[i]);
+                }
+                plotted = stats.history_count;
+            }
+            monitor_read_params(&monitor, nn, &version);
+        }
+
+        gym_begin_drawing();
+        ClearBackground(GYM_BACKGROUND);
+        {
+            int w = GetRenderWidth();
+            int h = GetRenderHeight();
+            char buffer[256];
+
+            if (monitor.header == NULL || version == 0) {
+                snprintf(buffer, sizeof(buffer), "Waiting for a trainer publishing into %s", name);
+                DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
+            } else {
+                Gym_Rect r;
+                r.w = w;
+                r.h = h*2/3;
+                r.x = 0;
+                r.y = h/2 - r.h/2;
+
+                gym_layout_begin(GLO_HORZ, r, 2, 10);
+                    gym_plot(plot, gym_layout_slot(), RED);
+                    gym_render_nn_weights_heatmap(nn, gym_layout_slot());
+                gym_layout_end();
+
+                snprintf(buffer, sizeof(buffer), "Epoch: %zu, Rate: %f, Cost: %f, Samples/s: %.0f, Snapshot: %llu%s",
+                         stats.epoch, stats.rate, stats.cost, stats.samples_per_sec, (unsigned long long) version,
+                         stale ? " (stopped)" : "");
+                DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
+            }
+        }
+        gym_end_drawing();
+    }
+
+    monitor_close(&monitor);
+    region_free(&attached);
+    gym_plot_free(&plot);
+    CloseWindow();
+    return 0;
+}
@@ -6,21 +6,32 @@
 
 size_t arch[] = {2, 2, 1};
 size_t max_epoch = 100*1000;
-size_t epochs_per_frame = 103;
 float rate = 1.0f;
 bool paused = true;
 
+// The truth table of the NN, only recomputed after it learned something
+Gym_NN_Stamp verify_stamp = {0};
+float verify_outputs[2][2];
+
 void verify_nn_gate(Font font, NN nn, Gym_Rect r)
 {
+    if (gym_nn_stamp_update(&verify_stamp, nn, NULL, 0)) {
+        for (size_t i = 0; i < 2; ++i) {
+            for (size_t j = 0; j < 2; ++j) {
+                ROW_AT(NN_INPUT(nn), 0) = i;
+                ROW_AT(NN_INPUT(nn), 1) = j;
+                nn_forward(nn);
+                verify_outputs[i][j] = ROW_AT(NN_OUTPUT(nn), 0);
+            }
+        }
+    }
+
     char buffer[256];
     float s = r.h*0.06;
     float pad = r.h*0.03;
     for (size_t i = 0; i < 2; ++i) {
         for (size_t j = 0; j < 2; ++j) {
-            ROW_AT(NN_INPUT(nn), 0) = i;
-            ROW_AT(NN_INPUT(nn), 1) = j;
-            nn_forward(nn);
-            snprintf(buffer, sizeof(buffer), "%zu @ %zu == %f", i, j, ROW_AT(NN_OUTPUT(nn), 0));
+            snprintf(buffer, sizeof(buffer), "%zu @ %zu == %f", i, j, verify_outputs[i][j]);
             DrawTextEx(font, buffer, CLITERAL(Vector2){r.x, r.y + (i*2 + j)*(s + pad)}, s, 0, WHITE);
         }
     }
@@ -28,7 +39,7 @@ void verify_nn_gate(Font font, NN nn, Gym_Rect r)
 
 int main(void)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
+    Region temp = region_alloc_growable(1024*1024, 0);
 
     Mat t = mat_alloc(NULL, 4, 3);
     for (size_t i = 0; i < 2; ++i) {
@@ -49,7 +60,8 @@ int main(void)
 
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "xor");
-    SetTargetFPS(60);
+    Gym_Frame_Budget frame;
+    gym_frame_budget_init(&frame);
 
     Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
@@ -57,6 +69,7 @@ int main(void)
     Gym_Plot plot = {0};
 
     size_t epoch = 0;
+    float cost = nn_cost(nn, t);
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
             paused = !paused;
@@ -64,17 +77,23 @@ int main(void)
         if (IsKeyPressed(KEY_R)) {
             epoch = 0;
             nn_rand(nn, -1, 1);
-            plot.count = 0;
+            gym_plot_reset(&plot);
+            cost = nn_cost(nn, t);
         }
 
-        for (size_t i = 0; i < epochs_per_frame && !paused && epoch < max_epoch; ++i) {
+        Train_Budget *train = gym_frame_train(&frame);
+        while (!paused && epoch < max_epoch && train_budget_next(train)) {
+            size_t s = region_save(&temp);
             NN g = nn_backprop(&temp, nn, t);
             nn_learn(nn, g, rate);
             epoch += 1;
-            da_append(&plot, nn_cost(nn, t));
+            cost = nn_cost(nn, t);
+            gym_plot_push(&plot, cost);
+            region_rewind(&temp, s);
         }
+        gym_frame_draw(&frame);
 
-        BeginDrawing();
+        gym_begin_drawing();
         ClearBackground(GYM_BACKGROUND);
         {
             int w = GetRenderWidth();
@@ -93,10 +112,11 @@ int main(void)
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes", epoch, max_epoch, rate, nn_cost(nn, t), region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes", epoch, max_epoch, rate, cost, region_occupied_bytes(&temp));
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
         }
-        EndDrawing();
+        gym_end_drawing();
+        gym_frame_end(&frame);
 
         region_reset(&temp);
     }
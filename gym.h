@@ -15,6 +15,70 @@
 #define GYM_ASSERT NN_ASSERT
 #endif // GYM_ASSERT
 
+#ifndef GYM_TILE_SIZE
+#define GYM_TILE_SIZE 32
+#endif // GYM_TILE_SIZE
+
+#ifndef GYM_ADAPTIVE_CELL
+#define GYM_ADAPTIVE_CELL 16
+#endif // GYM_ADAPTIVE_CELL
+
+// Textures of heatmaps kept around, the least recently drawn is dropped first
+#ifndef GYM_HEATMAP_CACHE_CAP
+#define GYM_HEATMAP_CACHE_CAP 64
+#endif // GYM_HEATMAP_CACHE_CAP
+
+// Buckets of a Gym_Plot, must be even since they are merged in pairs
+#ifndef GYM_PLOT_BUCKETS
+#define GYM_PLOT_BUCKETS 2048
+#endif // GYM_PLOT_BUCKETS
+_Static_assert(GYM_PLOT_BUCKETS%2 == 0 && GYM_PLOT_BUCKETS >= 2, "GYM_PLOT_BUCKETS must be even and at least 2");
+
+// Networks whose graph gym_render_nn() keeps in a RenderTexture
+#ifndef GYM_NN_RENDER_CACHE_CAP
+#define GYM_NN_RENDER_CACHE_CAP 8
+#endif // GYM_NN_RENDER_CACHE_CAP
+
+// gym_render_nn() redraws the graph once a parameter moves by more than this.
+// The slope of the sigmoid is at most 1/4, so smaller changes can not move the
+// color of an edge or a neuron by more than one level.
+#ifndef GYM_NN_REDRAW_EPS
+#define GYM_NN_REDRAW_EPS (4.f/255.f)
+#endif // GYM_NN_REDRAW_EPS
+
+// Most edges gym_render_nn() draws between two layers. Past that only the
+// strongest incoming edges of every neuron are drawn.
+#ifndef GYM_NN_EDGES_CAP
+#define GYM_NN_EDGES_CAP 2048
+#endif // GYM_NN_EDGES_CAP
+
+// Frame rate kept by Gym_Frame_Budget
+#ifndef GYM_FPS
+#define GYM_FPS 60
+#endif // GYM_FPS
+
+// Longest time the background trainer goes without publishing a snapshot
+#ifndef GYM_TRAINER_PUBLISH_NS
+#define GYM_TRAINER_PUBLISH_NS (1000*1000*1000/120)
+#endif // GYM_TRAINER_PUBLISH_NS
+
+// Frames kept by the profiler
+#ifndef GYM_PROF_FRAMES
+#define GYM_PROF_FRAMES 256
+#endif // GYM_PROF_FRAMES
+
+#ifndef GYM_PROF_OVERLAY_KEY
+#define GYM_PROF_OVERLAY_KEY KEY_F3
+#endif // GYM_PROF_OVERLAY_KEY
+
+#ifndef GYM_PROF_DUMP_KEY
+#define GYM_PROF_DUMP_KEY KEY_F4
+#endif // GYM_PROF_DUMP_KEY
+
+#ifndef GYM_PROF_CSV_PATH
+#define GYM_PROF_CSV_PATH "gym_profile.csv"
+#endif // GYM_PROF_CSV_PATH
+
 // The Tsoding Background Color
 #define GYM_BACKGROUND CLITERAL(Color) { 0x18, 0x18, 0x18, 0xFF }
 
@@ -33,11 +97,30 @@ typedef enum {
 } Gym_Layout_Orient;
 
 typedef struct {
-    float *items;
-    size_t count;
-    size_t capacity;
+    float first;
+    float last;
+    float min;
+    float max;
+} Gym_Plot_Bucket;
+
+// Every bucket summarizes span consecutive samples. Once all GYM_PLOT_BUCKETS
+// are taken the neighbours are merged and span doubles, so the memory is fixed
+// and gym_plot() draws at most two lines per pixel column of arbitrarily long
+// runs. Zero initialized is an empty plot.
+typedef struct {
+    Gym_Plot_Bucket *buckets;
+    size_t count;   // the last bucket may be partial
+    size_t span;
+    size_t samples; // pushed since the last reset
+    float min;
+    float max;
 } Gym_Plot;
 
+void gym_plot_push(Gym_Plot *plot, float x);
+void gym_plot_reset(Gym_Plot *plot);
+float gym_plot_last(Gym_Plot plot);
+void gym_plot_free(Gym_Plot *plot);
+
 typedef struct {
     Gym_Layout_Orient orient;
     Gym_Rect rect;
@@ -67,36 +150,333 @@ Gym_Rect gym_fit_square(Gym_Rect r);
 // TODO: allow a single slot to take up several slots
 #define gym_layout_slot() gym_layout_stack_slot(&default_gym_layout_stack)
 
-#define DA_INIT_CAP 256
-#define da_append(da, item)                                                          \
-    do {                                                                             \
-        if ((da)->count >= (da)->capacity) {                                         \
-            (da)->capacity = (da)->capacity == 0 ? DA_INIT_CAP : (da)->capacity*2;   \
-            (da)->items = realloc((da)->items, (da)->capacity*sizeof(*(da)->items)); \
-            GYM_ASSERT((da)->items != NULL && "Buy more RAM lol");                   \
-        }                                                                            \
-                                                                                     \
-        (da)->items[(da)->count++] = (item);                                         \
-    } while (0)
-
+// The graph is drawn into a RenderTexture cached by nn.ws and the size of r
+// and only redrawn when a parameter changed by more than GYM_NN_REDRAW_EPS.
+// Between layers with more than GYM_NN_EDGES_CAP connections only the top k
+// incoming edges by magnitude of every neuron are drawn, so the cost of a
+// redraw does not depend on the architecture.
 void gym_render_nn(NN nn, Gym_Rect r);
+// Maps the elements to colors on the CPU, uploads them into a texture with
+// a texel per element and draws it as a single quad. Textures are cached by
+// the elements and the size of the matrix.
 void gym_render_mat_as_heatmap(Mat m, Gym_Rect r, size_t max_width);
 void gym_render_nn_weights_heatmap(NN nn, Gym_Rect r);
 void gym_render_nn_activations_heatmap(NN nn, Gym_Rect r);
 void gym_plot(Gym_Plot plot, Gym_Rect r, Color c);
 void gym_slider(float *value, bool *dragging, float rx, float ry, float rw, float rh);
 void gym_nn_image_grayscale(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high);
+// Renders the image in GYM_TILE_SIZE x GYM_TILE_SIZE tiles on the workers of
+// pool (on the caller if pool is NULL). Every tile is forwarded as one batch
+// allocated in the scratch region of its worker. The inputs past the first two
+// are taken from NN_INPUT(nn) and nn.as is left untouched.
+void gym_nn_image_grayscale_pool(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high, Pool *pool);
+
+// Remembers which parameters and inputs something was computed from
+typedef struct {
+    const uint64_t *counter; // nn.version
+    uint64_t version;
+    float *inputs;
+    size_t inputs_count;
+    bool valid;
+} Gym_NN_Stamp;
+
+// Returns true and records the new state when nn (see nn_version()) or the
+// inputs changed since the last call. An NN without a version always changed.
+bool gym_nn_stamp_update(Gym_NN_Stamp *s, NN nn, const float *inputs, size_t inputs_count);
+void gym_nn_stamp_free(Gym_NN_Stamp *s);
+
+// A texture showing the image of an NN taking (x, y, in[2], ...) to a
+// brightness, as rendered by gym_nn_image_grayscale_pool()
+typedef struct {
+    Image image;
+    Texture2D texture;
+    Gym_NN_Stamp stamp;
+} Gym_NN_Preview;
+
+Gym_NN_Preview gym_nn_preview_load(size_t width, size_t height);
+void gym_nn_preview_unload(Gym_NN_Preview *p);
+// Renders and uploads the image only when the parameters or NN_INPUT(nn)
+// changed since the last update. Returns true if it did.
+bool gym_nn_preview_update(Gym_NN_Preview *p, NN nn, Pool *pool);
+
+// The pre-activation of the first layer for the pixel (x, y) is
+//
+//   x*ws[0][0] + y*ws[0][1] + (in[2]*ws[0][2] + ... + bs[0])
+//
+// so a width x height grid only needs width column terms, height row terms and
+// one constant term instead of a full dot product per pixel. Only the constant
+// depends on the inputs past the first two, so the column and row terms
+// computed by gym_nn_grid_init() can be reused for any number of renders (e.g.
+// the frames of a video) as long as the first layer of the NN does not change.
+typedef struct {
+    size_t width;
+    size_t height;
+    Mat xs;  // width x arch[1], x*ws[0][0]
+    Mat ys;  // height x arch[1], y*ws[0][1]
+} Gym_NN_Grid;
+
+// Layouts of frames for video export. The names match -pix_fmt of ffmpeg.
+typedef enum {
+    GYM_PIXEL_RGBA,    // 4 bytes per pixel
+    GYM_PIXEL_GRAY,    // 1 byte per pixel, full range
+    GYM_PIXEL_YUV420P, // limited range Y plane followed by U and V planes at half resolution
+    COUNT_GYM_PIXELS,
+} Gym_Pixel_Format;
+
+const char *gym_pixel_format_name(Gym_Pixel_Format format);
+size_t gym_frame_size(Gym_Pixel_Format format, size_t width, size_t height);
+// Fills the frame with black
+void gym_frame_clear(void *frame, Gym_Pixel_Format format, size_t width, size_t height);
+// Location of the pixel (x, y) of the frame (of the Y plane for YUV420P)
+void *gym_frame_at(void *frame, Gym_Pixel_Format format, size_t width, size_t x, size_t y);
+
+void gym_nn_grid_init(Region *r, Gym_NN_Grid *grid, NN nn, size_t width, size_t height);
+// input provides the inputs past the first two, the first two are ignored.
+// Neither grid nor nn are modified, so several renders can run at once.
+void gym_nn_grid_render(const Gym_NN_Grid *grid, NN nn, Row input, void *pixels, size_t stride, float low, float high, Pool *pool);
+// Same as gym_nn_grid_render() but writes the pixels in the given format. For
+// GYM_PIXEL_YUV420P pixels points into the Y plane, the chroma planes of a
+// grayscale image stay as gym_frame_clear() left them.
+void gym_nn_grid_render_format(const Gym_NN_Grid *grid, NN nn, Row input, void *pixels, size_t stride, float low, float high, Gym_Pixel_Format format, Pool *pool);
+
+// Evaluates the NN at the corners and centers of GYM_ADAPTIVE_CELL sized cells
+// and recursively splits the cells where those samples differ by more than
+// tolerance or where the center deviates from the interpolation of the corners
+// by more than tolerance. The remaining cells are filled by bilinear
+// interpolation, so the cost scales with the length of the edges in the
+// image rather than with its area. tolerance is in the units of the output
+// (the same as low and high) and bounds the error at the sampled points,
+// features smaller than a cell that fall between samples can still be missed.
+void gym_nn_image_grayscale_adaptive(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high, float tolerance, Pool *pool);
+
+// Renders the given frame into pixels (frame_size bytes). scratch is the
+// scratch region of the worker, rewound after every frame.
+typedef void (*Gym_Frame_Render)(void *arg, size_t frame, void *pixels, Region *scratch);
+
+// Renders frame_count frames concurrently on the workers of pool into a ring
+// of ring_count frame buffers while a writer thread writes them to fd in order
+// (e.g. to the stdin of ffmpeg). A worker does not start a frame until the
+// frame that used its slot is written, so a slow consumer throttles rendering
+// instead of growing memory. Returns false if writing failed, the remaining
+// frames are skipped then.
+bool gym_render_frames(int fd, size_t frame_count, size_t frame_size, size_t ring_count, Gym_Frame_Render render, void *arg, Pool *pool);
+
+// State of the training as seen by the UI
+typedef struct {
+    NN nn;          // copy of the parameters, the activations are free to use
+    size_t epoch;
+    size_t batches; // processed since the start or the last reset
+    float cost;     // of the last finished epoch
+} Gym_Snapshot;
+
+// Trains nn on a background thread as fast as it can while the UI draws at
+// its own frame rate. The trainer publishes a copy of the parameters after
+// every epoch and at least every GYM_TRAINER_PUBLISH_NS. There are three
+// snapshots: one being written by the trainer, the latest published one and
+// the one held by the UI. Publishing and acquiring only swap the indices under
+// the mutex, so neither side ever waits for the other one to copy or draw.
+typedef struct {
+    NN nn;
+    Dataset t;
+    size_t batch_size;
+    size_t max_epoch;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    float rate;
+    bool paused;
+    bool reset;
+    bool quit;
+
+    Gym_Snapshot snapshots[3];
+    size_t back;  // written by the trainer
+    size_t ready; // latest published
+    size_t front; // held by the UI
+    bool fresh;   // ready is newer than front
+
+    struct {
+        float *items;
+        size_t count;
+        size_t capacity;
+    } costs;                // of the epochs finished since the last acquire
+    size_t generation;      // bumped by every reset
+    size_t plot_generation; // of the plot passed to gym_trainer_acquire()
+    Region region;
+} Gym_Trainer;
+
+// nn and t belong to the trainer until gym_trainer_stop(). The trainer starts paused.
+bool gym_trainer_start(Gym_Trainer *tr, NN nn, Dataset t, size_t batch_size, float rate, size_t max_epoch);
+// Returns the latest snapshot, owned by the caller until the next call. The
+// costs of the epochs finished since the previous call are appended to plot,
+// which is cleared after a reset, so it must not be fed from anywhere else.
+Gym_Snapshot *gym_trainer_acquire(Gym_Trainer *tr, Gym_Plot *plot);
+void gym_trainer_set_paused(Gym_Trainer *tr, bool paused);
+void gym_trainer_set_rate(Gym_Trainer *tr, float rate);
+// Randomizes the parameters and starts over from the first epoch
+void gym_trainer_reset(Gym_Trainer *tr);
+void gym_trainer_stop(Gym_Trainer *tr);
+
+// Paces the frames to GYM_FPS and gives the training on the same thread all
+// the time of the frame that rendering does not need:
+//
+//   Gym_Frame_Budget fb;
+//   gym_frame_budget_init(&fb);
+//   while (!WindowShouldClose()) {
+//       Train_Budget *tb = gym_frame_train(&fb);
+//       while (!paused && train_budget_next(tb)) { ... }
+//       gym_frame_draw(&fb);
+//       gym_begin_drawing(); ... gym_end_drawing();
+//       gym_frame_end(&fb);
+//   }
+//
+// It replaces SetTargetFPS(), which would sleep the unused time away instead.
+typedef struct {
+    uint64_t period_ns;
+    uint64_t frame_start_ns;
+    uint64_t draw_start_ns;
+    float draw_ns; // EWMA of the time from gym_frame_draw() to gym_frame_end() without the present
+    Train_Budget train;
+} Gym_Frame_Budget;
+
+void gym_frame_budget_init(Gym_Frame_Budget *fb);
+// Starts the training budget of the frame: what is left of the frame after
+// the estimated drawing time
+Train_Budget *gym_frame_train(Gym_Frame_Budget *fb);
+void gym_frame_draw(Gym_Frame_Budget *fb);
+// Waits for the end of the frame if the training did not fill it up
+void gym_frame_end(Gym_Frame_Budget *fb);
+
+// Where the time of a frame goes. Zones nest, the time of a zone does not
+// include the zones started inside of it, and whatever is not covered by any
+// zone (logic, pacing) is counted as other.
+typedef enum {
+    GYM_PROF_TRAIN,   // from gym_frame_train() to gym_frame_draw()
+    GYM_PROF_PREVIEW, // NN inference of the previews
+    GYM_PROF_UPLOAD,  // texture uploads
+    GYM_PROF_DRAW,    // from gym_begin_drawing() to gym_end_drawing()
+    GYM_PROF_PRESENT, // EndDrawing()
+    GYM_PROF_PACING,  // waiting for the next frame of gym_set_target_fps() or Gym_Frame_Budget
+    GYM_PROF_OTHER,
+    COUNT_GYM_PROF_ZONES,
+} Gym_Prof_Zone;
+
+typedef struct {
+    float ms[COUNT_GYM_PROF_ZONES];
+    float total_ms;
+} Gym_Prof_Frame;
+
+#define GYM_PROF_DEPTH 8
+
+typedef struct {
+    Gym_Prof_Frame frames[GYM_PROF_FRAMES];
+    size_t count; // frames recorded, the last GYM_PROF_FRAMES are kept
+    Gym_Prof_Frame current;
+    Gym_Prof_Zone stack[GYM_PROF_DEPTH];
+    size_t depth;
+    uint64_t mark_ns; // since when the top of the stack is counted
+    uint64_t frame_start_ns;
+    bool overlay;
+} Gym_Profiler;
+
+static Gym_Profiler default_gym_profiler = {0};
+
+const char *gym_prof_zone_name(Gym_Prof_Zone zone);
+void gym_prof_begin(Gym_Prof_Zone zone);
+void gym_prof_end(Gym_Prof_Zone zone);
+// Runs the statement or block after it inside of the zone. Leaving it with
+// break or return skips gym_prof_end().
+#define gym_prof_scope(zone) \
+    for (bool gym_prof_scope_once = (gym_prof_begin(zone), true); gym_prof_scope_once; gym_prof_scope_once = (gym_prof_end(zone), false))
+// Closes the current frame and starts the next one
+void gym_prof_frame(void);
+// Milliseconds of the zone (COUNT_GYM_PROF_ZONES for the whole frame) that p
+// percent of the recorded frames stay under
+float gym_prof_percentile(Gym_Prof_Zone zone, float p);
+// Stacked bar per frame, oldest on the left, with the percentiles of every zone
+void gym_prof_overlay(Gym_Rect r);
+// One line per recorded frame, oldest first
+bool gym_prof_save_csv(const char *file_path);
+
+// BeginDrawing() and EndDrawing() timed as GYM_PROF_DRAW and GYM_PROF_PRESENT.
+// gym_end_drawing() also draws the overlay, toggled by GYM_PROF_OVERLAY_KEY,
+// saves GYM_PROF_CSV_PATH on GYM_PROF_DUMP_KEY and closes the frame.
+//
+// SetTargetFPS() waits inside of EndDrawing(), so that wait would be counted
+// as GYM_PROF_PRESENT. Use gym_set_target_fps() instead, it waits after
+// EndDrawing() and counts the wait as GYM_PROF_PACING.
+void gym_begin_drawing(void);
+void gym_end_drawing(void);
+// Paces gym_end_drawing() to fps frames per second, 0 does not wait
+void gym_set_target_fps(int fps);
 
 #endif // GYM_H_
 
 #ifdef GYM_IMPLEMENTATION
 
-void gym_render_nn(NN nn, Gym_Rect r)
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+// Time the last gym_end_drawing() spent in EndDrawing(), which waits for vsync
+static uint64_t gym_present_ns = 0;
+// Pacing of gym_end_drawing(), see gym_set_target_fps()
+static uint64_t gym_frame_period_ns = 0;
+static uint64_t gym_frame_next_ns = 0;
+
+typedef struct {
+    Mat *ws; // identifies the NN
+    size_t arch_count;
+    int width;
+    int height;
+    RenderTexture2D target;
+    float *params; // at the last redraw
+    size_t params_count;
+    uint64_t version; // nn_version() when params were last compared
+    size_t used;   // gym_nn_renders_clock of the last draw
+} Gym_NN_Render;
+
+static Gym_NN_Render gym_nn_renders[GYM_NN_RENDER_CACHE_CAP];
+static size_t gym_nn_renders_count = 0;
+static size_t gym_nn_renders_clock = 0;
+
+// Partially sorts xs so that xs[k] is the (k + 1)-th largest element
+static float gym_select_largest(float *xs, size_t n, size_t k)
+{
+    size_t lo = 0;
+    size_t hi = n - 1;
+    while (lo < hi) {
+        float pivot = xs[lo + (hi - lo)/2];
+        size_t i = lo;
+        size_t j = hi;
+        while (i <= j) {
+            while (xs[i] > pivot) i++;
+            while (xs[j] < pivot) j--;
+            if (i <= j) {
+                float t = xs[i];
+                xs[i] = xs[j];
+                xs[j] = t;
+                i++;
+                if (j == 0) break;
+                j--;
+            }
+        }
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+    return xs[k];
+}
+
+static void gym_render_nn_graph(NN nn, Gym_Rect r)
 {
     Color low_color = RED;
     Color high_color = DARKBLUE;
 
-    float neuron_radius = r.h*0.03;
     float layer_border_vpad = r.h*0.08;
     float layer_border_hpad = r.w*0.06;
     float nn_width = r.w - 2*layer_border_hpad;
@@ -104,59 +484,250 @@ void gym_render_nn(NN nn, Gym_Rect r)
     float nn_x = r.x + r.w/2 - nn_width/2;
     float nn_y = r.y + r.h/2 - nn_height/2;
     float layer_hpad = nn_width / nn.arch_count;
-    for (size_t l = 0; l < nn.arch_count; ++l) {
-        float layer_vpad1 = nn_height / nn.as[l].cols;
-        for (size_t i = 0; i < nn.as[l].cols; ++i) {
-            float cx1 = nn_x + l*layer_hpad + layer_hpad/2;
-            float cy1 = nn_y + i*layer_vpad1 + layer_vpad1/2;
-            if (l+1 < nn.arch_count) {
-                float layer_vpad2 = nn_height / nn.as[l+1].cols;
-                for (size_t j = 0; j < nn.as[l+1].cols; ++j) {
-                    // i - rows of ws
-                    // j - cols of ws
-                    float cx2 = nn_x + (l+1)*layer_hpad + layer_hpad/2;
-                    float cy2 = nn_y + j*layer_vpad2 + layer_vpad2/2;
-                    float value = sigmoidf(MAT_AT(nn.ws[l], i, j));
-                    high_color.a = floorf(255.f*value);
-                    float thick = r.h*0.004f;
-                    Vector2 start = {cx1, cy1};
-                    Vector2 end   = {cx2, cy2};
-                    DrawLineEx(start, end, thick, ColorAlphaBlend(low_color, high_color, WHITE));
-                }
+    float thick = r.h*0.004f;
+
+    Region *scratch = pool_scratch(NULL, 0);
+    size_t mark = region_save(scratch);
+
+    for (size_t l = 0; l + 1 < nn.arch_count; ++l) {
+        Mat w = nn.ws[l];
+        float layer_vpad1 = nn_height / w.rows;
+        float layer_vpad2 = nn_height / w.cols;
+        float cx1 = nn_x + l*layer_hpad + layer_hpad/2;
+        float cx2 = nn_x + (l+1)*layer_hpad + layer_hpad/2;
+
+        // Incoming edges of the neuron j are the column j of ws
+        size_t k = w.rows;
+        if (w.rows*w.cols > GYM_NN_EDGES_CAP) {
+            k = GYM_NN_EDGES_CAP/w.cols;
+            if (k == 0) k = 1;
+        }
+        float *column = region_alloc(scratch, sizeof(*column)*w.rows);
+        GYM_ASSERT(column != NULL);
+
+        for (size_t j = 0; j < w.cols; ++j) {
+            float threshold = 0;
+            if (k < w.rows) {
+                for (size_t i = 0; i < w.rows; ++i) column[i] = fabsf(MAT_AT(w, i, j));
+                threshold = gym_select_largest(column, w.rows, k - 1);
             }
+
+            float cy2 = nn_y + j*layer_vpad2 + layer_vpad2/2;
+            size_t drawn = 0;
+            for (size_t i = 0; i < w.rows && drawn < k; ++i) {
+                float x = MAT_AT(w, i, j);
+                if (fabsf(x) < threshold) continue;
+                float cy1 = nn_y + i*layer_vpad1 + layer_vpad1/2;
+                high_color.a = floorf(255.f*sigmoidf(x));
+                DrawLineEx(CLITERAL(Vector2){cx1, cy1}, CLITERAL(Vector2){cx2, cy2}, thick, ColorAlphaBlend(low_color, high_color, WHITE));
+                drawn += 1;
+            }
+        }
+    }
+
+    region_rewind(scratch, mark);
+
+    for (size_t l = 0; l < nn.arch_count; ++l) {
+        float layer_vpad = nn_height / nn.arch[l];
+        float neuron_radius = r.h*0.03;
+        if (neuron_radius > layer_vpad/2) neuron_radius = layer_vpad/2;
+        float cx = nn_x + l*layer_hpad + layer_hpad/2;
+        for (size_t i = 0; i < nn.arch[l]; ++i) {
+            float cy = nn_y + i*layer_vpad + layer_vpad/2;
             if (l > 0) {
                 high_color.a = floorf(255.f*sigmoidf(ROW_AT(nn.bs[l-1], i)));
-                DrawCircle(cx1, cy1, neuron_radius, ColorAlphaBlend(low_color, high_color, WHITE));
+                DrawCircle(cx, cy, neuron_radius, ColorAlphaBlend(low_color, high_color, WHITE));
             } else {
-                DrawCircle(cx1, cy1, neuron_radius, GRAY);
+                DrawCircle(cx, cy, neuron_radius, GRAY);
             }
         }
     }
 }
 
-void gym_render_mat_as_heatmap(Mat m, Gym_Rect r, size_t max_width)
+static Gym_NN_Render *gym_nn_render_get(NN nn, int width, int height)
 {
-    Color low_color = RED;
-    Color high_color = DARKBLUE;
+    gym_nn_renders_clock += 1;
 
-    float cell_width = r.w*m.cols/max_width/m.cols;
-    float cell_height = r.h/m.rows;
+    Gym_NN_Render *lru = NULL;
+    for (size_t i = 0; i < gym_nn_renders_count; ++i) {
+        Gym_NN_Render *c = &gym_nn_renders[i];
+        if (c->ws == nn.ws && c->arch_count == nn.arch_count) {
+            c->used = gym_nn_renders_clock;
+            if (c->width != width || c->height != height) {
+                UnloadRenderTexture(c->target);
+                c->target = LoadRenderTexture(width, height);
+                c->width = width;
+                c->height = height;
+                c->params_count = 0;
+            }
+            return c;
+        }
+        if (lru == NULL || c->used < lru->used) lru = c;
+    }
 
-    float full_width = r.w*m.cols/max_width;
+    Gym_NN_Render *c;
+    if (gym_nn_renders_count < GYM_NN_RENDER_CACHE_CAP) {
+        c = &gym_nn_renders[gym_nn_renders_count++];
+    } else {
+        c = lru;
+        UnloadRenderTexture(c->target);
+        NN_FREE(c->params);
+    }
+    memset(c, 0, sizeof(*c));
+    c->ws = nn.ws;
+    c->arch_count = nn.arch_count;
+    c->width = width;
+    c->height = height;
+    c->target = LoadRenderTexture(width, height);
+    c->used = gym_nn_renders_clock;
+    return c;
+}
+
+void gym_render_nn(NN nn, Gym_Rect r)
+{
+    int width = ceilf(r.w);
+    int height = ceilf(r.h);
+    if (width <= 0 || height <= 0) return;
+
+    Gym_NN_Render *c = gym_nn_render_get(nn, width, height);
+
+    // The parameters are only compared after nn.h changed them
+    bool changed = nn.version == NULL || c->params_count == 0 || c->version != *nn.version;
+    c->version = nn_version(nn);
+
+    size_t params_count = nn_param_count(nn);
+    Region *scratch = pool_scratch(NULL, 0);
+    size_t mark = region_save(scratch);
+    bool redraw = false;
+    float *params = NULL;
+    if (changed) {
+        params = region_alloc(scratch, sizeof(*params)*params_count);
+        GYM_ASSERT(params != NULL);
+        nn_params_get(nn, params);
+
+        redraw = c->params_count != params_count;
+        for (size_t i = 0; i < params_count && !redraw; ++i) {
+            redraw = fabsf(params[i] - c->params[i]) > GYM_NN_REDRAW_EPS;
+        }
+    }
+
+    if (redraw) {
+        if (c->params_count != params_count) {
+            NN_FREE(c->params);
+            c->params = nn_malloc(sizeof(*c->params)*params_count);
+            GYM_ASSERT(c->params != NULL);
+            c->params_count = params_count;
+        }
+        memcpy(c->params, params, sizeof(*params)*params_count);
+
+        BeginTextureMode(c->target);
+        ClearBackground(BLANK);
+        gym_render_nn_graph(nn, gym_rect(0, 0, width, height));
+        EndTextureMode();
+    }
+    region_rewind(scratch, mark);
+
+    // Render textures are upside down
+    Rectangle source = { 0, 0, width, -height };
+    DrawTextureRec(c->target.texture, source, CLITERAL(Vector2){r.x, r.y}, WHITE);
+}
+
+typedef struct {
+    const float *elements;
+    size_t rows;
+    size_t cols;
+    Texture2D texture;
+    Color *pixels;
+    size_t used; // gym_heatmaps_clock of the last draw
+} Gym_Heatmap;
 
+static Gym_Heatmap gym_heatmaps[GYM_HEATMAP_CACHE_CAP];
+static size_t gym_heatmaps_count = 0;
+static size_t gym_heatmaps_clock = 0;
+// Colors for floorf(255*sigmoidf(x)) of the elements
+static Color gym_heatmap_palette[256];
+static bool gym_heatmap_palette_ready = false;
+
+// Palette entry of the element. A diverged training easily produces NaNs,
+// they get the entry of the lowest value instead of an out of bounds index.
+static size_t gym_heatmap_index(float x)
+{
+    float i = floorf(255.f*sigmoidf(x));
+    if (!(i >= 0)) return 0;
+    if (i > 255) return 255;
+    return (size_t) i;
+}
+
+static Gym_Heatmap *gym_heatmap_get(Mat m)
+{
+    gym_heatmaps_clock += 1;
+
+    Gym_Heatmap *lru = NULL;
+    for (size_t i = 0; i < gym_heatmaps_count; ++i) {
+        Gym_Heatmap *h = &gym_heatmaps[i];
+        if (h->elements == m.elements && h->rows == m.rows && h->cols == m.cols) {
+            h->used = gym_heatmaps_clock;
+            return h;
+        }
+        if (lru == NULL || h->used < lru->used) lru = h;
+    }
+
+    Gym_Heatmap *h;
+    if (gym_heatmaps_count < GYM_HEATMAP_CACHE_CAP) {
+        h = &gym_heatmaps[gym_heatmaps_count++];
+    } else {
+        h = lru;
+        UnloadTexture(h->texture);
+        NN_FREE(h->pixels);
+    }
+
+    h->elements = m.elements;
+    h->rows = m.rows;
+    h->cols = m.cols;
+    h->used = gym_heatmaps_clock;
+    h->pixels = nn_malloc(sizeof(*h->pixels)*m.rows*m.cols);
+    GYM_ASSERT(h->pixels != NULL);
+    memset(h->pixels, 0, sizeof(*h->pixels)*m.rows*m.cols);
+    Image image = {
+        .data = h->pixels,
+        .width = m.cols,
+        .height = m.rows,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    h->texture = LoadTextureFromImage(image);
+    return h;
+}
+
+void gym_render_mat_as_heatmap(Mat m, Gym_Rect r, size_t max_width)
+{
+    if (m.rows == 0 || m.cols == 0) return;
+
+    if (!gym_heatmap_palette_ready) {
+        Color low_color = RED;
+        Color high_color = DARKBLUE;
+        for (size_t i = 0; i < ARRAY_LEN(gym_heatmap_palette); ++i) {
+            high_color.a = i;
+            gym_heatmap_palette[i] = ColorAlphaBlend(low_color, high_color, WHITE);
+        }
+        gym_heatmap_palette_ready = true;
+    }
+
+    Gym_Heatmap *h = gym_heatmap_get(m);
     for (size_t y = 0; y < m.rows; ++y) {
+        Color *row = &h->pixels[y*m.cols];
         for (size_t x = 0; x < m.cols; ++x) {
-            high_color.a = floorf(255.f*sigmoidf(MAT_AT(m, y, x)));
-            Color color = ColorAlphaBlend(low_color, high_color, WHITE);
-            Gym_Rect slot = {
-                r.x + r.w/2 - full_width/2 + x*cell_width,
-                r.y + y*cell_height,
-                cell_width,
-                cell_height,
-            };
-            DrawRectangle(ceilf(slot.x), ceilf(slot.y), ceilf(slot.w), ceilf(slot.h), color);
+            row[x] = gym_heatmap_palette[gym_heatmap_index(MAT_AT(m, y, x))];
         }
     }
+    gym_prof_begin(GYM_PROF_UPLOAD);
+    UpdateTexture(h->texture, h->pixels);
+    gym_prof_end(GYM_PROF_UPLOAD);
+
+    float full_width = r.w*m.cols/max_width;
+    Rectangle source = { 0, 0, m.cols, m.rows };
+    Rectangle dest = { r.x + r.w/2 - full_width/2, r.y, full_width, r.h };
+    DrawTexturePro(h->texture, source, dest, CLITERAL(Vector2){0}, 0, WHITE);
 }
 
 void gym_render_nn_weights_heatmap(NN nn, Gym_Rect r)
@@ -191,32 +762,115 @@ void gym_render_nn_activations_heatmap(NN nn, Gym_Rect r)
     gym_layout_end();
 }
 
-void gym_plot(Gym_Plot plot, Gym_Rect r, Color c)
+void gym_plot_push(Gym_Plot *plot, float x)
 {
-    float min = FLT_MAX, max = FLT_MIN;
-    for (size_t i = 0; i < plot.count; ++i) {
-        if (max < plot.items[i]) max = plot.items[i];
-        if (min > plot.items[i]) min = plot.items[i];
+    if (plot->buckets == NULL) {
+        plot->buckets = nn_malloc(sizeof(*plot->buckets)*GYM_PLOT_BUCKETS);
+        GYM_ASSERT(plot->buckets != NULL && "Buy more RAM lol");
+        plot->count = 0;
+        plot->span = 1;
+        plot->samples = 0;
     }
 
+    if (plot->samples == plot->count*plot->span) {
+        if (plot->count == GYM_PLOT_BUCKETS) {
+            for (size_t i = 0; i < plot->count/2; ++i) {
+                Gym_Plot_Bucket a = plot->buckets[2*i];
+                Gym_Plot_Bucket b = plot->buckets[2*i + 1];
+                plot->buckets[i] = (Gym_Plot_Bucket) {
+                    .first = a.first,
+                    .last = b.last,
+                    .min = a.min < b.min ? a.min : b.min,
+                    .max = a.max > b.max ? a.max : b.max,
+                };
+            }
+            plot->count /= 2;
+            plot->span *= 2;
+        }
+        plot->buckets[plot->count++] = (Gym_Plot_Bucket) {x, x, x, x};
+    } else {
+        Gym_Plot_Bucket *b = &plot->buckets[plot->count - 1];
+        b->last = x;
+        if (b->min > x) b->min = x;
+        if (b->max < x) b->max = x;
+    }
+
+    if (plot->samples == 0 || plot->min > x) plot->min = x;
+    if (plot->samples == 0 || plot->max < x) plot->max = x;
+    plot->samples += 1;
+}
+
+void gym_plot_reset(Gym_Plot *plot)
+{
+    plot->count = 0;
+    plot->span = 1;
+    plot->samples = 0;
+}
+
+float gym_plot_last(Gym_Plot plot)
+{
+    return plot.count > 0 ? plot.buckets[plot.count - 1].last : 0;
+}
+
+void gym_plot_free(Gym_Plot *plot)
+{
+    NN_FREE(plot->buckets);
+    memset(plot, 0, sizeof(*plot));
+}
+
+static float gym_plot_y(Gym_Rect r, float min, float max, float v)
+{
+    return r.y + (1 - (v - min)/(max - min))*r.h;
+}
+
+void gym_plot(Gym_Plot plot, Gym_Rect r, Color c)
+{
+    float min = plot.min, max = plot.max;
+    if (plot.samples == 0) min = max = 0;
     if (min > 0) min = 0;
-    size_t n = plot.count;
+    if (max <= min) max = min + 1;
+    float thick = r.h*0.005;
+
+    // Buckets falling into the same pixel column are merged into one vertical
+    // line, the columns are connected from the last sample to the first one
+    size_t n = plot.samples;
     if (n < 1000) n = 1000;
-    for (size_t i = 0; i+1 < plot.count; ++i) {
-        float x1 = r.x + r.w/n*i;
-        float y1 = r.y + (1 - (plot.items[i] - min)/(max - min))*r.h;
-        float x2 = r.x + (float)r.w/n*(i+1);
-        float y2 = r.y + (1 - (plot.items[i+1] - min)/(max - min))*r.h;
-        DrawLineEx((Vector2){x1, y1}, (Vector2){x2, y2}, r.h*0.005, c);
+    bool has_prev = false;
+    float prev_x = 0, prev_last = 0;
+    for (size_t i = 0; i < plot.count;) {
+        float x = r.x + r.w*((float)(i*plot.span)/n);
+        float column = floorf(x);
+        Gym_Plot_Bucket acc = plot.buckets[i++];
+        float x_end = x;
+        for (; i < plot.count; ++i) {
+            float xi = r.x + r.w*((float)(i*plot.span)/n);
+            if (floorf(xi) != column) break;
+            Gym_Plot_Bucket b = plot.buckets[i];
+            acc.last = b.last;
+            if (acc.min > b.min) acc.min = b.min;
+            if (acc.max < b.max) acc.max = b.max;
+            x_end = xi;
+        }
+
+        if (has_prev) {
+            DrawLineEx((Vector2){prev_x, gym_plot_y(r, min, max, prev_last)}, (Vector2){x, gym_plot_y(r, min, max, acc.first)}, thick, c);
+        }
+        if (acc.min < acc.max) {
+            float xm = (x + x_end)/2;
+            DrawLineEx((Vector2){xm, gym_plot_y(r, min, max, acc.max)}, (Vector2){xm, gym_plot_y(r, min, max, acc.min)}, thick, c);
+        }
+        has_prev = true;
+        prev_x = x_end;
+        prev_last = acc.last;
     }
 
-    float y0 = r.y + (1 - (0 - min)/(max - min))*r.h;
-    DrawLineEx((Vector2){r.x + 0, y0}, (Vector2){r.x + r.w - 1, y0}, r.h*0.005, WHITE);
+    float y0 = gym_plot_y(r, min, max, 0);
+    DrawLineEx((Vector2){r.x + 0, y0}, (Vector2){r.x + r.w - 1, y0}, thick, WHITE);
     DrawText("0", r.x + 0, y0 - r.h*0.04, r.h*0.04, WHITE);
 
-    if (plot.count > 0) {
+    if (plot.samples > 0) {
         char buffer[64];
-        snprintf(buffer, sizeof(buffer), "%f", plot.items[plot.count-1]);
+        snprintf(buffer, sizeof(buffer), "%f", gym_plot_last(plot));
         DrawText(buffer, r.x, r.y, r.h*0.08, WHITE);
     }
 }
@@ -261,21 +915,1010 @@ void gym_slider(float *value, bool *dragging, float rx, float ry, float rw, floa
 
 void gym_nn_image_grayscale(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high)
 {
+    gym_nn_image_grayscale_pool(nn, pixels, width, height, stride, low, high, NULL);
+}
+
+bool gym_nn_stamp_update(Gym_NN_Stamp *s, NN nn, const float *inputs, size_t inputs_count)
+{
+    bool changed = !s->valid || nn.version == NULL || s->counter != nn.version || s->version != *nn.version;
+    if (!changed) {
+        changed = s->inputs_count != inputs_count ||
+            (inputs_count > 0 && memcmp(s->inputs, inputs, sizeof(*inputs)*inputs_count) != 0);
+    }
+    if (!changed) return false;
+
+    if (s->inputs_count != inputs_count) {
+        s->inputs = nn_realloc(s->inputs, sizeof(*s->inputs)*inputs_count);
+        GYM_ASSERT(inputs_count == 0 || s->inputs != NULL);
+        s->inputs_count = inputs_count;
+    }
+    if (inputs_count > 0) memcpy(s->inputs, inputs, sizeof(*inputs)*inputs_count);
+    s->counter = nn.version;
+    s->version = nn_version(nn);
+    s->valid = true;
+    return true;
+}
+
+void gym_nn_stamp_free(Gym_NN_Stamp *s)
+{
+    NN_FREE(s->inputs);
+    memset(s, 0, sizeof(*s));
+}
+
+Gym_NN_Preview gym_nn_preview_load(size_t width, size_t height)
+{
+    Gym_NN_Preview p = {0};
+    p.image = GenImageColor(width, height, BLACK);
+    p.texture = LoadTextureFromImage(p.image);
+    return p;
+}
+
+void gym_nn_preview_unload(Gym_NN_Preview *p)
+{
+    UnloadTexture(p->texture);
+    UnloadImage(p->image);
+    gym_nn_stamp_free(&p->stamp);
+}
+
+bool gym_nn_preview_update(Gym_NN_Preview *p, NN nn, Pool *pool)
+{
+    Row in = NN_INPUT(nn);
+    if (!gym_nn_stamp_update(&p->stamp, nn, in.elements, in.cols)) return false;
+    gym_prof_begin(GYM_PROF_PREVIEW);
+    gym_nn_image_grayscale_pool(nn, p->image.data, p->image.width, p->image.height, p->image.width, 0, 1, pool);
+    gym_prof_end(GYM_PROF_PREVIEW);
+    gym_prof_begin(GYM_PROF_UPLOAD);
+    UpdateTexture(p->texture, p->image.data);
+    gym_prof_end(GYM_PROF_UPLOAD);
+    return true;
+}
+
+void gym_nn_image_grayscale_pool(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high, Pool *pool)
+{
+    // The grid lives in the scratch region of the calling thread, the tiles
+    // allocate past it
+    Region *scratch = pool_scratch(NULL, 0);
+    size_t s = region_save(scratch);
+    Gym_NN_Grid grid;
+    gym_nn_grid_init(scratch, &grid, nn, width, height);
+    gym_nn_grid_render(&grid, nn, NN_INPUT(nn), pixels, stride, low, high, pool);
+    region_rewind(scratch, s);
+}
+
+void gym_nn_grid_init(Region *r, Gym_NN_Grid *grid, NN nn, size_t width, size_t height)
+{
+    GYM_ASSERT(nn.arch_count >= 2);
     GYM_ASSERT(NN_INPUT(nn).cols >= 2);
     GYM_ASSERT(NN_OUTPUT(nn).cols >= 1);
+    Mat w = nn.ws[0];
+    grid->width = width;
+    grid->height = height;
+    grid->xs = mat_alloc(r, width, w.cols);
+    grid->ys = mat_alloc(r, height, w.cols);
+    for (size_t x = 0; x < width; ++x) {
+        float fx = (float)x/(float)(width - 1);
+        for (size_t j = 0; j < w.cols; ++j) {
+            MAT_AT(grid->xs, x, j) = fx*MAT_AT(w, 0, j);
+        }
+    }
+    for (size_t y = 0; y < height; ++y) {
+        float fy = (float)y/(float)(height - 1);
+        for (size_t j = 0; j < w.cols; ++j) {
+            MAT_AT(grid->ys, y, j) = fy*MAT_AT(w, 1, j);
+        }
+    }
+}
+
+// The constant term of the first layer for the given inputs
+static Row gym_nn_grid_constant(Region *r, NN nn, Row input)
+{
+    Mat w = nn.ws[0];
+    GYM_ASSERT(input.cols == w.rows);
+    Row c = row_alloc(r, w.cols);
+    for (size_t j = 0; j < w.cols; ++j) {
+        float sum = ROW_AT(nn.bs[0], j);
+        for (size_t k = 2; k < input.cols; ++k) {
+            sum += ROW_AT(input, k)*MAT_AT(w, k, j);
+        }
+        ROW_AT(c, j) = sum;
+    }
+    return c;
+}
+
+static void gym_nn_grid_first_layer(const Gym_NN_Grid *grid, Row c, Row row, size_t x, size_t y)
+{
+    Row xs = mat_row(grid->xs, x);
+    Row ys = mat_row(grid->ys, y);
+    for (size_t j = 0; j < row.cols; ++j) {
+        ROW_AT(row, j) = actf(ROW_AT(xs, j) + ROW_AT(ys, j) + ROW_AT(c, j), NN_ACT);
+    }
+}
+
+typedef struct {
+    const Gym_NN_Grid *grid;
+    Row c;
+    NN nn;
+    Pool *pool;
+    void *pixels;
+    Gym_Pixel_Format format;
+    size_t stride;
+    float low;
+    float high;
+    size_t tiles_x;
+} Gym_Image_Tiles;
+
+static void gym_nn_image_tile(void *arg, size_t index, size_t worker)
+{
+    Gym_Image_Tiles *t = arg;
+    const Gym_NN_Grid *grid = t->grid;
+    Region *scratch = pool_scratch(t->pool, worker);
+
+    size_t x0 = index%t->tiles_x*GYM_TILE_SIZE;
+    size_t y0 = index/t->tiles_x*GYM_TILE_SIZE;
+    size_t tw = grid->width - x0 < GYM_TILE_SIZE ? grid->width - x0 : GYM_TILE_SIZE;
+    size_t th = grid->height - y0 < GYM_TILE_SIZE ? grid->height - y0 : GYM_TILE_SIZE;
+
+    // First layer from the separable terms, the rest as one batch
+    Mat a = mat_alloc(scratch, tw*th, t->c.cols);
+    for (size_t y = 0; y < th; ++y) {
+        for (size_t x = 0; x < tw; ++x) {
+            gym_nn_grid_first_layer(grid, t->c, mat_row(a, y*tw + x), x0 + x, y0 + y);
+        }
+    }
+    Mat out = nn_forward_batch_from(scratch, t->nn, a, 1);
+
+    for (size_t y = 0; y < th; ++y) {
+        for (size_t x = 0; x < tw; ++x) {
+            float v = MAT_AT(out, y*tw + x, 0);
+            if (v < t->low) v = t->low;
+            if (v > t->high) v = t->high;
+            uint32_t pixel = (v - t->low)/(t->high - t->low)*255.f;
+            size_t i = (y0 + y)*t->stride + x0 + x;
+            switch (t->format) {
+            case GYM_PIXEL_RGBA:
+                ((uint32_t*)t->pixels)[i] = (0xFF<<(8*3))|(pixel<<(8*2))|(pixel<<(8*1))|(pixel<<(8*0));
+                break;
+            case GYM_PIXEL_GRAY:
+                ((uint8_t*)t->pixels)[i] = pixel;
+                break;
+            case GYM_PIXEL_YUV420P:
+                ((uint8_t*)t->pixels)[i] = ((220*pixel + 128)>>8) + 16;
+                break;
+            default:
+                GYM_ASSERT(0 && "Unreachable");
+            }
+        }
+    }
+}
+
+void gym_nn_grid_render(const Gym_NN_Grid *grid, NN nn, Row input, void *pixels, size_t stride, float low, float high, Pool *pool)
+{
+    gym_nn_grid_render_format(grid, nn, input, pixels, stride, low, high, GYM_PIXEL_RGBA, pool);
+}
+
+void gym_nn_grid_render_format(const Gym_NN_Grid *grid, NN nn, Row input, void *pixels, size_t stride, float low, float high, Gym_Pixel_Format format, Pool *pool)
+{
+    Region *scratch = pool_scratch(NULL, 0);
+    size_t s = region_save(scratch);
+
+    Gym_Image_Tiles t = {
+        .grid = grid,
+        .c = gym_nn_grid_constant(scratch, nn, input),
+        .nn = nn,
+        .pool = pool,
+        .pixels = pixels,
+        .format = format,
+        .stride = stride,
+        .low = low,
+        .high = high,
+        .tiles_x = (grid->width + GYM_TILE_SIZE - 1)/GYM_TILE_SIZE,
+    };
+    size_t tiles_y = (grid->height + GYM_TILE_SIZE - 1)/GYM_TILE_SIZE;
+    pool_run(pool, t.tiles_x*tiles_y, gym_nn_image_tile, &t);
+
+    region_rewind(scratch, s);
+}
+
+typedef struct {
+    size_t x0, y0, x1, y1; // inclusive corners
+} Gym_Cell;
+
+typedef struct {
+    const Gym_NN_Grid *grid;
+    Row c;
+    NN nn;
+    Pool *pool;
+    const uint32_t *points; // indices of the samples, y*width + x
+    size_t points_count;
+    float *values;
+    float low;
+    float high;
+} Gym_Samples;
+
+#define GYM_SAMPLES_CHUNK (GYM_TILE_SIZE*GYM_TILE_SIZE)
+
+static void gym_nn_samples_chunk(void *arg, size_t index, size_t worker)
+{
+    Gym_Samples *s = arg;
+    Region *scratch = pool_scratch(s->pool, worker);
+    size_t begin = index*GYM_SAMPLES_CHUNK;
+    size_t count = s->points_count - begin < GYM_SAMPLES_CHUNK ? s->points_count - begin : GYM_SAMPLES_CHUNK;
+    size_t width = s->grid->width;
+
+    Mat a = mat_alloc(scratch, count, s->c.cols);
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t p = s->points[begin + i];
+        gym_nn_grid_first_layer(s->grid, s->c, mat_row(a, i), p%width, p/width);
+    }
+    Mat out = nn_forward_batch_from(scratch, s->nn, a, 1);
+    for (size_t i = 0; i < count; ++i) {
+        float v = MAT_AT(out, i, 0);
+        if (v < s->low) v = s->low;
+        if (v > s->high) v = s->high;
+        s->values[s->points[begin + i]] = v;
+    }
+}
+
+void gym_nn_image_grayscale_adaptive(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high, float tolerance, Pool *pool)
+{
+    Region *scratch = pool_scratch(NULL, 0);
+    size_t s = region_save(scratch);
+
+    Gym_NN_Grid grid;
+    gym_nn_grid_init(scratch, &grid, nn, width, height);
+    Row c = gym_nn_grid_constant(scratch, nn, NN_INPUT(nn));
+
+    size_t n = width*height;
+    float *values = region_alloc(scratch, sizeof(*values)*n);
+    // 0 - unknown, 1 - evaluated
+    uint8_t *evaluated = region_alloc(scratch, n);
+    memset(evaluated, 0, n);
+    uint32_t *points = region_alloc(scratch, sizeof(*points)*n);
+    Gym_Cell *cells = region_alloc(scratch, sizeof(*cells)*n);
+    Gym_Cell *next = region_alloc(scratch, sizeof(*next)*n);
+    GYM_ASSERT(values != NULL && evaluated != NULL && points != NULL && cells != NULL && next != NULL);
+
+    size_t cells_count = 0;
+    for (size_t y0 = 0; y0 + 1 < height || y0 == 0; y0 += GYM_ADAPTIVE_CELL) {
+        for (size_t x0 = 0; x0 + 1 < width || x0 == 0; x0 += GYM_ADAPTIVE_CELL) {
+            cells[cells_count++] = (Gym_Cell) {
+                .x0 = x0,
+                .y0 = y0,
+                .x1 = x0 + GYM_ADAPTIVE_CELL < width ? x0 + GYM_ADAPTIVE_CELL : width - 1,
+                .y1 = y0 + GYM_ADAPTIVE_CELL < height ? y0 + GYM_ADAPTIVE_CELL : height - 1,
+            };
+        }
+    }
+
+#define GYM_SAMPLE(x, y)                                     \
+    do {                                                     \
+        size_t p = (y)*width + (x);                          \
+        if (!evaluated[p]) {                                 \
+            evaluated[p] = 1;                                \
+            points[points_count++] = p;                      \
+        }                                                    \
+    } while (0)
+
+    while (cells_count > 0) {
+        // Evaluate the corners and the centers of all the cells of this level at once
+        size_t points_count = 0;
+        for (size_t i = 0; i < cells_count; ++i) {
+            Gym_Cell c = cells[i];
+            GYM_SAMPLE(c.x0, c.y0);
+            GYM_SAMPLE(c.x1, c.y0);
+            GYM_SAMPLE(c.x0, c.y1);
+            GYM_SAMPLE(c.x1, c.y1);
+            GYM_SAMPLE((c.x0 + c.x1)/2, (c.y0 + c.y1)/2);
+        }
+        Gym_Samples samples = {
+            .grid = &grid,
+            .c = c,
+            .nn = nn,
+            .pool = pool,
+            .points = points,
+            .points_count = points_count,
+            .values = values,
+            .low = low,
+            .high = high,
+        };
+        pool_run(pool, (points_count + GYM_SAMPLES_CHUNK - 1)/GYM_SAMPLES_CHUNK, gym_nn_samples_chunk, &samples);
+
+        // Interpolate the cells that are flat enough, split the rest
+        size_t next_count = 0;
+        for (size_t i = 0; i < cells_count; ++i) {
+            Gym_Cell c = cells[i];
+            if (c.x1 - c.x0 <= 1 && c.y1 - c.y0 <= 1) continue;
+
+            float v00 = values[c.y0*width + c.x0];
+            float v10 = values[c.y0*width + c.x1];
+            float v01 = values[c.y1*width + c.x0];
+            float v11 = values[c.y1*width + c.x1];
+            float vmin = fminf(fminf(v00, v10), fminf(v01, v11));
+            float vmax = fmaxf(fmaxf(v00, v10), fmaxf(v01, v11));
+            size_t mx = (c.x0 + c.x1)/2;
+            size_t my = (c.y0 + c.y1)/2;
+            float tx = c.x1 > c.x0 ? (float)(mx - c.x0)/(float)(c.x1 - c.x0) : 0;
+            float ty = c.y1 > c.y0 ? (float)(my - c.y0)/(float)(c.y1 - c.y0) : 0;
+            float center = (v00*(1 - tx) + v10*tx)*(1 - ty) + (v01*(1 - tx) + v11*tx)*ty;
+
+            if (vmax - vmin <= tolerance && fabsf(values[my*width + mx] - center) <= tolerance) {
+                for (size_t y = c.y0; y <= c.y1; ++y) {
+                    float ty = c.y1 > c.y0 ? (float)(y - c.y0)/(float)(c.y1 - c.y0) : 0;
+                    for (size_t x = c.x0; x <= c.x1; ++x) {
+                        if (evaluated[y*width + x]) continue;
+                        float tx = c.x1 > c.x0 ? (float)(x - c.x0)/(float)(c.x1 - c.x0) : 0;
+                        values[y*width + x] = (v00*(1 - tx) + v10*tx)*(1 - ty) + (v01*(1 - tx) + v11*tx)*ty;
+                    }
+                }
+                continue;
+            }
+
+            size_t xs[3] = {c.x0, mx, c.x1};
+            size_t ys[3] = {c.y0, my, c.y1};
+            size_t xn = c.x1 - c.x0 > 1 ? 2 : 1;
+            size_t yn = c.y1 - c.y0 > 1 ? 2 : 1;
+            if (xn == 1) xs[1] = c.x1;
+            if (yn == 1) ys[1] = c.y1;
+            for (size_t iy = 0; iy < yn; ++iy) {
+                for (size_t ix = 0; ix < xn; ++ix) {
+                    next[next_count++] = (Gym_Cell) {
+                        .x0 = xs[ix],
+                        .y0 = ys[iy],
+                        .x1 = xs[ix + 1],
+                        .y1 = ys[iy + 1],
+                    };
+                }
+            }
+        }
+
+        Gym_Cell *t = cells;
+        cells = next;
+        next = t;
+        cells_count = next_count;
+    }
+#undef GYM_SAMPLE
+
     uint32_t *pixels_u32 = pixels;
     for (size_t y = 0; y < height; ++y) {
         for (size_t x = 0; x < width; ++x) {
-            ROW_AT(NN_INPUT(nn), 0) = (float)x/(float)(width - 1);
-            ROW_AT(NN_INPUT(nn), 1) = (float)y/(float)(height - 1);
-            nn_forward(nn);
-            float a = ROW_AT(NN_OUTPUT(nn), 0);
-            if (a < low) a = low;
-            if (a > high) a = high;
-            uint32_t pixel = (a - low)/(high - low)*255.f;
+            uint32_t pixel = (values[y*width + x] - low)/(high - low)*255.f;
             pixels_u32[y*stride + x] = (0xFF<<(8*3))|(pixel<<(8*2))|(pixel<<(8*1))|(pixel<<(8*0));
         }
     }
+
+    region_rewind(scratch, s);
+}
+
+const char *gym_pixel_format_name(Gym_Pixel_Format format)
+{
+    switch (format) {
+    case GYM_PIXEL_RGBA:    return "rgba";
+    case GYM_PIXEL_GRAY:    return "gray";
+    case GYM_PIXEL_YUV420P: return "yuv420p";
+    default:                GYM_ASSERT(0 && "Unreachable");
+    }
+    return NULL;
+}
+
+size_t gym_frame_size(Gym_Pixel_Format format, size_t width, size_t height)
+{
+    switch (format) {
+    case GYM_PIXEL_RGBA:    return 4*width*height;
+    case GYM_PIXEL_GRAY:    return width*height;
+    case GYM_PIXEL_YUV420P: return width*height + 2*((width + 1)/2)*((height + 1)/2);
+    default:                GYM_ASSERT(0 && "Unreachable");
+    }
+    return 0;
+}
+
+void gym_frame_clear(void *frame, Gym_Pixel_Format format, size_t width, size_t height)
+{
+    switch (format) {
+    case GYM_PIXEL_RGBA: {
+        uint32_t *pixels = frame;
+        for (size_t i = 0; i < width*height; ++i) pixels[i] = 0xFF000000;
+    } break;
+    case GYM_PIXEL_GRAY:
+        memset(frame, 0, width*height);
+        break;
+    case GYM_PIXEL_YUV420P:
+        memset(frame, 16, width*height);
+        memset((uint8_t*)frame + width*height, 128, gym_frame_size(format, width, height) - width*height);
+        break;
+    default:
+        GYM_ASSERT(0 && "Unreachable");
+    }
+}
+
+void *gym_frame_at(void *frame, Gym_Pixel_Format format, size_t width, size_t x, size_t y)
+{
+    switch (format) {
+    case GYM_PIXEL_RGBA:    return (uint32_t*)frame + y*width + x;
+    case GYM_PIXEL_GRAY:
+    case GYM_PIXEL_YUV420P: return (uint8_t*)frame + y*width + x;
+    default:                GYM_ASSERT(0 && "Unreachable");
+    }
+    return NULL;
+}
+
+typedef struct {
+    int fd;
+    size_t frame_count;
+    size_t frame_size;
+    size_t ring_count;
+    uint8_t *ring;
+    size_t *ring_frames; // frame that is ready in the slot, SIZE_MAX if none
+    size_t written;      // frames written so far
+    bool failed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Gym_Frame_Render render;
+    void *arg;
+    Pool *pool;
+} Gym_Frames;
+
+static bool gym_write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t n = write(fd, bytes, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ERROR: could not write frame: %s\n", strerror(errno));
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void *gym_frames_writer(void *arg)
+{
+    Gym_Frames *f = arg;
+    pthread_mutex_lock(&f->mutex);
+    while (!f->failed && f->written < f->frame_count) {
+        size_t slot = f->written%f->ring_count;
+        if (f->ring_frames[slot] != f->written) {
+            pthread_cond_wait(&f->cond, &f->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&f->mutex);
+        bool ok = gym_write_all(f->fd, &f->ring[slot*f->frame_size], f->frame_size);
+        pthread_mutex_lock(&f->mutex);
+        if (ok) {
+            f->ring_frames[slot] = SIZE_MAX;
+            f->written += 1;
+        } else {
+            f->failed = true;
+        }
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return NULL;
+}
+
+static void gym_frames_render(void *arg, size_t frame, size_t worker)
+{
+    Gym_Frames *f = arg;
+    size_t slot = frame%f->ring_count;
+
+    // Backpressure: wait until the frame that used the slot before is written
+    pthread_mutex_lock(&f->mutex);
+    while (!f->failed && frame >= f->written + f->ring_count) {
+        pthread_cond_wait(&f->cond, &f->mutex);
+    }
+    bool failed = f->failed;
+    pthread_mutex_unlock(&f->mutex);
+    if (failed) return;
+
+    f->render(f->arg, frame, &f->ring[slot*f->frame_size], pool_scratch(f->pool, worker));
+
+    pthread_mutex_lock(&f->mutex);
+    f->ring_frames[slot] = frame;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+bool gym_render_frames(int fd, size_t frame_count, size_t frame_size, size_t ring_count, Gym_Frame_Render render, void *arg, Pool *pool)
+{
+    GYM_ASSERT(ring_count > 0);
+    bool result = true;
+
+    Gym_Frames f = {
+        .fd = fd,
+        .frame_count = frame_count,
+        .frame_size = frame_size,
+        .ring_count = ring_count,
+        .render = render,
+        .arg = arg,
+        .pool = pool,
+    };
+    f.ring = nn_malloc(ring_count*frame_size);
+    GYM_ASSERT(f.ring != NULL);
+    f.ring_frames = nn_malloc(sizeof(*f.ring_frames)*ring_count);
+    GYM_ASSERT(f.ring_frames != NULL);
+    for (size_t i = 0; i < ring_count; ++i) f.ring_frames[i] = SIZE_MAX;
+    pthread_mutex_init(&f.mutex, NULL);
+    pthread_cond_init(&f.cond, NULL);
+
+    pthread_t writer;
+    int err = pthread_create(&writer, NULL, gym_frames_writer, &f);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: could not start frame writer: %s\n", strerror(err));
+        result = false;
+        goto defer;
+    }
+    pool_run(pool, frame_count, gym_frames_render, &f);
+    pthread_join(writer, NULL);
+    result = !f.failed;
+
+defer:
+    pthread_mutex_destroy(&f.mutex);
+    pthread_cond_destroy(&f.cond);
+    NN_FREE(f.ring_frames);
+    NN_FREE(f.ring);
+    return result;
+}
+
+static void gym_nn_copy(NN dst, NN src)
+{
+    GYM_ASSERT(dst.arch_count == src.arch_count);
+    for (size_t i = 0; i < src.arch_count - 1; ++i) {
+        mat_copy(dst.ws[i], src.ws[i]);
+        row_copy(dst.bs[i], src.bs[i]);
+    }
+    nn_touch(dst);
+}
+
+// Only the trainer changes back, so the copy needs no locking
+static void gym_trainer_copy_back(Gym_Trainer *tr, size_t epoch, size_t batches, float cost)
+{
+    Gym_Snapshot *s = &tr->snapshots[tr->back];
+    gym_nn_copy(s->nn, tr->nn);
+    s->epoch = epoch;
+    s->batches = batches;
+    s->cost = cost;
+}
+
+// Called with the mutex locked
+static void gym_trainer_swap_back(Gym_Trainer *tr)
+{
+    size_t back = tr->back;
+    tr->back = tr->ready;
+    tr->ready = back;
+    tr->fresh = true;
+}
+
+static void *gym_trainer_thread(void *arg)
+{
+    Gym_Trainer *tr = arg;
+    Region temp = region_alloc_growable(1024*1024, 0);
+    Batch batch = {0};
+    size_t epoch = 0;
+    size_t batches = 0;
+    float cost = 0;
+    uint64_t published = nn_now_ns();
+    bool unpublished = false; // tr->nn changed since the last snapshot
+
+    pthread_mutex_lock(&tr->mutex);
+    for (;;) {
+        while (!tr->quit && !tr->reset && (tr->paused || epoch >= tr->max_epoch)) {
+            // The last updates are published before blocking, otherwise a
+            // paused UI would keep showing an older snapshot
+            if (unpublished) {
+                pthread_mutex_unlock(&tr->mutex);
+                gym_trainer_copy_back(tr, epoch, batches, cost);
+                pthread_mutex_lock(&tr->mutex);
+                gym_trainer_swap_back(tr);
+                unpublished = false;
+                published = nn_now_ns();
+                continue;
+            }
+            pthread_cond_wait(&tr->cond, &tr->mutex);
+        }
+        if (tr->quit) break;
+        bool reset = tr->reset;
+        tr->reset = false;
+        float rate = tr->rate;
+        pthread_mutex_unlock(&tr->mutex);
+
+        bool finished = false;
+        if (reset) {
+            nn_rand(tr->nn, -1, 1);
+            batch = (Batch) {0};
+            epoch = 0;
+            batches = 0;
+            cost = 0;
+        } else {
+            dataset_batch_process(&temp, &batch, tr->batch_size, tr->nn, tr->t, rate);
+            region_reset(&temp);
+            batches += 1;
+            finished = batch.finished;
+            if (finished) {
+                epoch += 1;
+                cost = batch.cost;
+                dataset_shuffle(&tr->t);
+            }
+        }
+
+        uint64_t now = nn_now_ns();
+        bool publish = reset || finished || now - published >= GYM_TRAINER_PUBLISH_NS;
+        if (publish) {
+            gym_trainer_copy_back(tr, epoch, batches, cost);
+            published = now;
+        }
+
+        pthread_mutex_lock(&tr->mutex);
+        unpublished = !publish;
+        if (reset) {
+            tr->costs.count = 0;
+            tr->generation += 1;
+        }
+        if (finished) da_append(&tr->costs, cost);
+        if (publish) gym_trainer_swap_back(tr);
+    }
+    pthread_mutex_unlock(&tr->mutex);
+
+    region_free(&temp);
+    return NULL;
+}
+
+bool gym_trainer_start(Gym_Trainer *tr, NN nn, Dataset t, size_t batch_size, float rate, size_t max_epoch)
+{
+    memset(tr, 0, sizeof(*tr));
+    tr->nn = nn;
+    tr->t = t;
+    tr->batch_size = batch_size;
+    tr->max_epoch = max_epoch;
+    tr->rate = rate;
+    tr->paused = true;
+    tr->region = region_alloc_growable(64*1024, 0);
+    for (size_t i = 0; i < ARRAY_LEN(tr->snapshots); ++i) {
+        tr->snapshots[i].nn = nn_alloc(&tr->region, nn.arch, nn.arch_count);
+        gym_nn_copy(tr->snapshots[i].nn, nn);
+    }
+    tr->back = 0;
+    tr->ready = 1;
+    tr->front = 2;
+
+    pthread_mutex_init(&tr->mutex, NULL);
+    pthread_cond_init(&tr->cond, NULL);
+    int err = pthread_create(&tr->thread, NULL, gym_trainer_thread, tr);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: could not start trainer: %s\n", strerror(err));
+        pthread_mutex_destroy(&tr->mutex);
+        pthread_cond_destroy(&tr->cond);
+        region_free(&tr->region);
+        return false;
+    }
+    return true;
+}
+
+Gym_Snapshot *gym_trainer_acquire(Gym_Trainer *tr, Gym_Plot *plot)
+{
+    pthread_mutex_lock(&tr->mutex);
+    if (tr->fresh) {
+        size_t front = tr->front;
+        tr->front = tr->ready;
+        tr->ready = front;
+        tr->fresh = false;
+    }
+    if (tr->plot_generation != tr->generation) {
+        gym_plot_reset(plot);
+        tr->plot_generation = tr->generation;
+    }
+    for (size_t i = 0; i < tr->costs.count; ++i) {
+        gym_plot_push(plot, tr->costs.items[i]);
+    }
+    tr->costs.count = 0;
+    pthread_mutex_unlock(&tr->mutex);
+    return &tr->snapshots[tr->front];
+}
+
+void gym_trainer_set_paused(Gym_Trainer *tr, bool paused)
+{
+    pthread_mutex_lock(&tr->mutex);
+    tr->paused = paused;
+    pthread_cond_signal(&tr->cond);
+    pthread_mutex_unlock(&tr->mutex);
+}
+
+void gym_trainer_set_rate(Gym_Trainer *tr, float rate)
+{
+    pthread_mutex_lock(&tr->mutex);
+    tr->rate = rate;
+    pthread_mutex_unlock(&tr->mutex);
+}
+
+void gym_trainer_reset(Gym_Trainer *tr)
+{
+    pthread_mutex_lock(&tr->mutex);
+    tr->reset = true;
+    pthread_cond_signal(&tr->cond);
+    pthread_mutex_unlock(&tr->mutex);
+}
+
+void gym_trainer_stop(Gym_Trainer *tr)
+{
+    pthread_mutex_lock(&tr->mutex);
+    tr->quit = true;
+    pthread_cond_signal(&tr->cond);
+    pthread_mutex_unlock(&tr->mutex);
+    pthread_join(tr->thread, NULL);
+
+    pthread_mutex_destroy(&tr->mutex);
+    pthread_cond_destroy(&tr->cond);
+    NN_FREE(tr->costs.items);
+    region_free(&tr->region);
+}
+
+static void gym_sleep_ns(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns/(1000*1000*1000),
+        .tv_nsec = ns%(1000*1000*1000),
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+void gym_frame_budget_init(Gym_Frame_Budget *fb)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->period_ns = 1000*1000*1000/GYM_FPS;
+    fb->frame_start_ns = nn_now_ns();
+    gym_set_target_fps(0);
+}
+
+Train_Budget *gym_frame_train(Gym_Frame_Budget *fb)
+{
+    gym_prof_begin(GYM_PROF_TRAIN);
+    uint64_t used = nn_now_ns() - fb->frame_start_ns + (uint64_t) fb->draw_ns;
+    train_for_ns(&fb->train, used < fb->period_ns ? fb->period_ns - used : 0);
+    return &fb->train;
+}
+
+void gym_frame_draw(Gym_Frame_Budget *fb)
+{
+    gym_prof_end(GYM_PROF_TRAIN);
+    fb->draw_start_ns = nn_now_ns();
+}
+
+void gym_frame_end(Gym_Frame_Budget *fb)
+{
+    uint64_t now = nn_now_ns();
+    uint64_t frame_ns = now - fb->draw_start_ns;
+    // Waiting for vsync is not drawing, counting it would leave no time to train
+    float draw_ns = frame_ns > gym_present_ns ? frame_ns - gym_present_ns : 0;
+    gym_present_ns = 0;
+    fb->draw_ns = fb->draw_ns == 0 ? draw_ns : fb->draw_ns + (draw_ns - fb->draw_ns)/8;
+
+    uint64_t frame_end = fb->frame_start_ns + fb->period_ns;
+    if (now < frame_end) {
+        gym_prof_begin(GYM_PROF_PACING);
+        gym_sleep_ns(frame_end - now);
+        gym_prof_end(GYM_PROF_PACING);
+        fb->frame_start_ns = frame_end;
+    } else {
+        // Missed the frame, do not try to catch up
+        fb->frame_start_ns = now;
+    }
+}
+
+const char *gym_prof_zone_name(Gym_Prof_Zone zone)
+{
+    switch (zone) {
+    case GYM_PROF_TRAIN:   return "train";
+    case GYM_PROF_PREVIEW: return "preview";
+    case GYM_PROF_UPLOAD:  return "upload";
+    case GYM_PROF_DRAW:    return "draw";
+    case GYM_PROF_PRESENT: return "present";
+    case GYM_PROF_PACING:  return "pacing";
+    case GYM_PROF_OTHER:   return "other";
+    default:               GYM_ASSERT(0 && "Unreachable");
+    }
+    return NULL;
+}
+
+static Color gym_prof_zone_color(Gym_Prof_Zone zone)
+{
+    switch (zone) {
+    case GYM_PROF_TRAIN:   return ORANGE;
+    case GYM_PROF_PREVIEW: return PURPLE;
+    case GYM_PROF_UPLOAD:  return SKYBLUE;
+    case GYM_PROF_DRAW:    return GREEN;
+    case GYM_PROF_PRESENT: return YELLOW;
+    case GYM_PROF_PACING:  return DARKGRAY;
+    case GYM_PROF_OTHER:   return GRAY;
+    default:               GYM_ASSERT(0 && "Unreachable");
+    }
+    return BLANK;
+}
+
+// Counts the time since the last mark to the zone on the top of the stack
+static void gym_prof_mark(Gym_Profiler *p, uint64_t now)
+{
+    if (p->depth > 0) p->current.ms[p->stack[p->depth - 1]] += (now - p->mark_ns)*1e-6f;
+    p->mark_ns = now;
+}
+
+void gym_prof_begin(Gym_Prof_Zone zone)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    GYM_ASSERT(p->depth < GYM_PROF_DEPTH);
+    gym_prof_mark(p, nn_now_ns());
+    p->stack[p->depth++] = zone;
+}
+
+void gym_prof_end(Gym_Prof_Zone zone)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    GYM_ASSERT(p->depth > 0 && p->stack[p->depth - 1] == zone);
+    gym_prof_mark(p, nn_now_ns());
+    p->depth -= 1;
+}
+
+void gym_prof_frame(void)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    uint64_t now = nn_now_ns();
+    gym_prof_mark(p, now);
+
+    if (p->frame_start_ns != 0) {
+        Gym_Prof_Frame *f = &p->current;
+        f->total_ms = (now - p->frame_start_ns)*1e-6f;
+        float covered = 0;
+        for (size_t i = 0; i < GYM_PROF_OTHER; ++i) covered += f->ms[i];
+        f->ms[GYM_PROF_OTHER] = covered < f->total_ms ? f->total_ms - covered : 0;
+        p->frames[p->count%GYM_PROF_FRAMES] = *f;
+        p->count += 1;
+    }
+    memset(&p->current, 0, sizeof(p->current));
+    p->frame_start_ns = now;
+}
+
+static int gym_prof_compare_ms(const void *a, const void *b)
+{
+    float x = *(const float*)a;
+    float y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+float gym_prof_percentile(Gym_Prof_Zone zone, float p)
+{
+    Gym_Profiler *prof = &default_gym_profiler;
+    size_t n = prof->count < GYM_PROF_FRAMES ? prof->count : GYM_PROF_FRAMES;
+    if (n == 0) return 0;
+
+    float ms[GYM_PROF_FRAMES];
+    for (size_t i = 0; i < n; ++i) {
+        ms[i] = zone == COUNT_GYM_PROF_ZONES ? prof->frames[i].total_ms : prof->frames[i].ms[zone];
+    }
+    qsort(ms, n, sizeof(*ms), gym_prof_compare_ms);
+    size_t k = (size_t) ceilf(p/100*n);
+    if (k > 0) k -= 1;
+    if (k >= n) k = n - 1;
+    return ms[k];
+}
+
+void gym_prof_overlay(Gym_Rect r)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    DrawRectangleRec((Rectangle){r.x, r.y, r.w, r.h}, ColorAlpha(BLACK, 0.75f));
+
+    // The bars take the lower half, two frame periods tall
+    float font_size = r.h*0.07f;
+    float period_ms = 1000.f/GYM_FPS;
+    float bars_h = r.h/2;
+    float bars_y = r.y + r.h - bars_h;
+    float scale = bars_h/(2*period_ms);
+    float bar_w = r.w/GYM_PROF_FRAMES;
+
+    size_t n = p->count < GYM_PROF_FRAMES ? p->count : GYM_PROF_FRAMES;
+    for (size_t i = 0; i < n; ++i) {
+        const Gym_Prof_Frame *f = &p->frames[(p->count - n + i)%GYM_PROF_FRAMES];
+        float x = r.x + (GYM_PROF_FRAMES - n + i)*bar_w;
+        float y = bars_y + bars_h;
+        for (size_t z = 0; z < COUNT_GYM_PROF_ZONES && y > bars_y; ++z) {
+            float h = f->ms[z]*scale;
+            if (h > y - bars_y) h = y - bars_y;
+            y -= h;
+            DrawRectangleRec((Rectangle){x, y, bar_w, h}, gym_prof_zone_color(z));
+        }
+    }
+    float period_y = bars_y + bars_h - period_ms*scale;
+    DrawLineEx((Vector2){r.x, period_y}, (Vector2){r.x + r.w, period_y}, 1, WHITE);
+
+    char buffer[128];
+    float y = r.y + font_size*0.25f;
+    snprintf(buffer, sizeof(buffer), "frame   p50 %6.2f  p95 %6.2f  p99 %6.2f ms",
+             gym_prof_percentile(COUNT_GYM_PROF_ZONES, 50),
+             gym_prof_percentile(COUNT_GYM_PROF_ZONES, 95),
+             gym_prof_percentile(COUNT_GYM_PROF_ZONES, 99));
+    DrawText(buffer, r.x + font_size*0.5f, y, font_size, WHITE);
+    for (size_t z = 0; z < COUNT_GYM_PROF_ZONES; ++z) {
+        y += font_size;
+        if (y + font_size > bars_y) break;
+        snprintf(buffer, sizeof(buffer), "%-7s p50 %6.2f  p95 %6.2f  p99 %6.2f ms", gym_prof_zone_name(z),
+                 gym_prof_percentile(z, 50), gym_prof_percentile(z, 95), gym_prof_percentile(z, 99));
+        DrawText(buffer, r.x + font_size*0.5f, y, font_size, gym_prof_zone_color(z));
+    }
+}
+
+bool gym_prof_save_csv(const char *file_path)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    FILE *f = fopen(file_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    fprintf(f, "frame,total_ms");
+    for (size_t z = 0; z < COUNT_GYM_PROF_ZONES; ++z) fprintf(f, ",%s_ms", gym_prof_zone_name(z));
+    fprintf(f, "\n");
+
+    size_t n = p->count < GYM_PROF_FRAMES ? p->count : GYM_PROF_FRAMES;
+    for (size_t i = p->count - n; i < p->count; ++i) {
+        const Gym_Prof_Frame *frame = &p->frames[i%GYM_PROF_FRAMES];
+        fprintf(f, "%zu,%f", i, frame->total_ms);
+        for (size_t z = 0; z < COUNT_GYM_PROF_ZONES; ++z) fprintf(f, ",%f", frame->ms[z]);
+        fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "ERROR: could not write %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void gym_begin_drawing(void)
+{
+    gym_prof_begin(GYM_PROF_DRAW);
+    BeginDrawing();
+}
+
+void gym_end_drawing(void)
+{
+    Gym_Profiler *p = &default_gym_profiler;
+    if (IsKeyPressed(GYM_PROF_OVERLAY_KEY)) p->overlay = !p->overlay;
+    if (IsKeyPressed(GYM_PROF_DUMP_KEY) && gym_prof_save_csv(GYM_PROF_CSV_PATH)) {
+        printf("Generated %s\n", GYM_PROF_CSV_PATH);
+    }
+    if (p->overlay) {
+        float w = GetRenderWidth();
+        float h = GetRenderHeight();
+        gym_prof_overlay(gym_rect(w*0.6f, 0, w*0.4f, h*0.35f));
+    }
+    gym_prof_end(GYM_PROF_DRAW);
+
+    gym_prof_begin(GYM_PROF_PRESENT);
+    uint64_t present_start = nn_now_ns();
+    EndDrawing();
+    gym_present_ns = nn_now_ns() - present_start;
+    gym_prof_end(GYM_PROF_PRESENT);
+
+    if (gym_frame_period_ns > 0) {
+        gym_prof_begin(GYM_PROF_PACING);
+        uint64_t now = nn_now_ns();
+        if (now < gym_frame_next_ns) {
+            gym_sleep_ns(gym_frame_next_ns - now);
+            now = gym_frame_next_ns;
+        }
+        // A missed frame is not caught up
+        gym_frame_next_ns = now + gym_frame_period_ns;
+        gym_prof_end(GYM_PROF_PACING);
+    }
+
+    gym_prof_frame();
+}
+
+void gym_set_target_fps(int fps)
+{
+    SetTargetFPS(0);
+    gym_frame_period_ns = fps > 0 ? 1000*1000*1000/fps : 0;
+    gym_frame_next_ns = 0;
 }
 
 Gym_Rect gym_rect(float x, float y, float w, float h)
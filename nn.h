@@ -10,6 +10,8 @@
 #include <stdbool.h>
 #include <math.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 // #define NN_BACKPROP_TRADITIONAL
 
@@ -21,18 +23,112 @@
 #define NN_RELU_PARAM 0.01f
 #endif // NN_RELU_PARAM
 
+// Alignment in bytes of the elements allocated by mat_alloc()
+#ifndef NN_MAT_ALIGN
+#define NN_MAT_ALIGN 64
+#endif // NN_MAT_ALIGN
+
+// mat_alloc() pads the row stride to a multiple of NN_MAT_PAD floats (e.g. 8
+// for AVX, 16 for AVX-512) and keeps the padding lanes zeroed, so nn_forward()
+// can process whole groups of lanes without remainder loops
+#ifndef NN_MAT_PAD
+#define NN_MAT_PAD 1
+#endif // NN_MAT_PAD
+
+// Block of the matrix product of nn_forward_batch(), the rows are the samples
+// and the columns the neurons of a layer
+#ifndef NN_FORWARD_BLOCK_ROWS
+#define NN_FORWARD_BLOCK_ROWS 4
+#endif // NN_FORWARD_BLOCK_ROWS
+
+#ifndef NN_FORWARD_BLOCK_COLS
+#define NN_FORWARD_BLOCK_COLS 16
+#endif // NN_FORWARD_BLOCK_COLS
+
+// region_reset() gives the pages of an mmap-backed region past this many bytes
+// back to the OS once the region has grown beyond it, but only after the
+// usage stayed below half of the committed pages for
+// NN_REGION_MMAP_RELEASE_AFTER resets in a row. A region using the same large
+// amount every step keeps its pages (and huge pages) instead of faulting them
+// in again every time.
+#ifndef NN_REGION_MMAP_KEEP
+#define NN_REGION_MMAP_KEEP (16*1024*1024)
+#endif // NN_REGION_MMAP_KEEP
+
+#ifndef NN_REGION_MMAP_RELEASE_AFTER
+#define NN_REGION_MMAP_RELEASE_AFTER 64
+#endif // NN_REGION_MMAP_RELEASE_AFTER
+
+// Address space reserved for the scratch region of every Pool worker
+#ifndef NN_POOL_SCRATCH_CAPACITY
+#define NN_POOL_SCRATCH_CAPACITY (1024*1024*1024)
+#endif // NN_POOL_SCRATCH_CAPACITY
+
 #ifndef NN_MALLOC
 #include <stdlib.h>
 #define NN_MALLOC malloc
 #endif // NN_MALLOC
 
+#ifndef NN_REALLOC
+#include <stdlib.h>
+#define NN_REALLOC realloc
+#endif // NN_REALLOC
+
+#ifndef NN_FREE
+#include <stdlib.h>
+#define NN_FREE free
+#endif // NN_FREE
+
+// Used by region_alloc_aligned(NULL, ...), the result is released with NN_FREE
+#ifndef NN_MALLOC_ALIGNED
+#define NN_MALLOC_ALIGNED(size_bytes, alignment) nn_posix_memalign((size_bytes), (alignment))
+#endif // NN_MALLOC_ALIGNED
+
 #ifndef NN_ASSERT
 #include <assert.h>
 #define NN_ASSERT assert
 #endif // NN_ASSERT
 
+// Allocation tracing, enabled by defining NN_TRACE_ALLOC. Every region_alloc(),
+// region_alloc_aligned() and every NN_MALLOC/NN_REALLOC made by nn.h, gym.h and
+// da_append() is recorded per call site (file, line and function). mat_alloc(),
+// row_alloc() and nn_alloc() are recorded at the site that called them.
+// Regions keep their peak usage. alloc_trace_step() marks the end of a
+// training step and alloc_trace_report() prints everything, including the
+// number of allocations made by the last step.
+#ifdef NN_TRACE_ALLOC
+#ifndef NN_TRACE_SITES_CAP
+#define NN_TRACE_SITES_CAP 512
+#endif // NN_TRACE_SITES_CAP
+#ifndef NN_TRACE_REGIONS_CAP
+#define NN_TRACE_REGIONS_CAP 64
+#endif // NN_TRACE_REGIONS_CAP
+void *alloc_trace_malloc(void *result, size_t size_bytes, const char *file, int line, const char *func);
+void alloc_trace_step(void);
+void alloc_trace_report(FILE *stream);
+#define nn_malloc(size_bytes) alloc_trace_malloc(NN_MALLOC(size_bytes), (size_bytes), __FILE__, __LINE__, __func__)
+#define nn_realloc(ptr, size_bytes) alloc_trace_malloc(NN_REALLOC((ptr), (size_bytes)), (size_bytes), __FILE__, __LINE__, __func__)
+#else
+#define alloc_trace_step() ((void) 0)
+#define alloc_trace_report(stream) ((void) (stream))
+#define nn_malloc NN_MALLOC
+#define nn_realloc NN_REALLOC
+#endif // NN_TRACE_ALLOC
+
 #define ARRAY_LEN(xs) sizeof((xs))/sizeof((xs)[0])
 
+#define DA_INIT_CAP 256
+#define da_append(da, item)                                                             \
+    do {                                                                                \
+        if ((da)->count >= (da)->capacity) {                                            \
+            (da)->capacity = (da)->capacity == 0 ? DA_INIT_CAP : (da)->capacity*2;      \
+            (da)->items = nn_realloc((da)->items, (da)->capacity*sizeof(*(da)->items)); \
+            NN_ASSERT((da)->items != NULL && "Buy more RAM lol");                       \
+        }                                                                               \
+                                                                                        \
+        (da)->items[(da)->count++] = (item);                                            \
+    } while (0)
+
 typedef enum {
     ACT_SIG,
     ACT_RELU,
@@ -40,6 +136,11 @@ typedef enum {
     ACT_SIN,
 } Act;
 
+// nn.h keeps its own random state instead of rand() so it can be saved
+// and restored by the checkpoints
+void rand_seed(uint64_t state);
+uint64_t rand_state(void);
+uint64_t rand_u64(void);
 float rand_float(void);
 
 float sigmoidf(float x);
@@ -52,24 +153,84 @@ float actf(float x, Act act);
 // Derivative of the activation function based on its value
 float dactf(float y, Act act);
 
+typedef struct Region_Block Region_Block;
+
+struct Region_Block {
+    Region_Block *next;
+    size_t begin;    // position of words[0] within the whole region, in words
+    size_t capacity; // in words
+    uintptr_t words[];
+};
+
+// The fields capacity, size and words describe the block the region is
+// currently allocating from. Blocks are never moved, so pointers returned by
+// region_alloc() stay valid until the region is rewound past them.
 typedef struct {
     size_t capacity;
     size_t size;
     uintptr_t *words;
+
+    Region_Block *first;
+    Region_Block *current;
+    size_t allocated; // total capacity of all the blocks, in words
+    size_t max;       // limit of allocated, in words, 0 - unlimited
+    size_t peak;      // highest position left by region_rewind()/region_reset(), in words
+    size_t mapped;    // size of the mapping of region_alloc_mmap(), in bytes
+    size_t touched;   // highest position since pages were last released, in words
+    size_t cycle_peak;  // highest position since the last region_reset(), in words
+    size_t idle_resets; // resets in a row with cycle_peak below half of touched
+    bool growable;
 } Region;
 
 // capacity is in bytes, but it can allocate more just to keep things
 // word aligned
 Region region_alloc_alloc(size_t capacity_bytes);
+// Starts with a block of initial_bytes and chains new blocks, each twice as
+// big as the previous one, whenever the current block runs out. max_bytes
+// caps the total capacity of the region, 0 means no cap.
+Region region_alloc_growable(size_t initial_bytes, size_t max_bytes);
+// Reserves capacity_bytes of address space with mmap(MAP_NORESERVE). Pages are
+// committed lazily by the first write, large regions are advised to use
+// transparent huge pages and region_reset() drops the pages above
+// NN_REGION_MMAP_KEEP that went unused for a while, so the resident size
+// follows what is actually used.
+Region region_alloc_mmap(size_t capacity_bytes);
+void region_free(Region *r);
 void *region_alloc(Region *r, size_t size_bytes);
-#define region_reset(r) (NN_ASSERT((r) != NULL), (r)->size = 0)
-#define region_occupied_bytes(r) (NN_ASSERT((r) != NULL), (r)->size*sizeof(*(r)->words))
-#define region_save(r) (NN_ASSERT((r) != NULL), (r)->size)
-#define region_rewind(r, s) (NN_ASSERT((r) != NULL), (r)->size = s)
+// alignment must be a power of two. With r == NULL the memory comes from
+// NN_MALLOC_ALIGNED and is released with NN_FREE.
+void *region_alloc_aligned(Region *r, size_t size_bytes, size_t alignment);
+// Positions returned by region_save() are counted across all the blocks, so
+// rewinding to one of them may move the region back to an earlier block.
+// Blocks past the rewound position are kept around and reused by the
+// following allocations.
+void region_reset(Region *r);
+size_t region_occupied_bytes(const Region *r);
+// Highest occupied bytes so far. Without NN_TRACE_ALLOC it is only updated by
+// region_rewind() and region_reset().
+size_t region_peak_bytes(const Region *r);
+size_t region_capacity_bytes(const Region *r);
+size_t region_save(const Region *r);
+void region_rewind(Region *r, size_t s);
+
+#ifdef NN_TRACE_ALLOC
+void *alloc_trace_region(Region *r, void *result, size_t size_bytes, const char *file, int line, const char *func);
+// Name to show for the region in alloc_trace_report()
+void alloc_trace_region_name(const Region *r, const char *name);
+#define region_alloc(r, size_bytes) alloc_trace_region((r), (region_alloc)((r), (size_bytes)), (size_bytes), __FILE__, __LINE__, __func__)
+#define region_alloc_aligned(r, size_bytes, alignment) alloc_trace_region((r), (region_alloc_aligned)((r), (size_bytes), (alignment)), (size_bytes), __FILE__, __LINE__, __func__)
+#define region_alloc_loc(r, size_bytes, file, line, func) alloc_trace_region((r), (region_alloc)((r), (size_bytes)), (size_bytes), (file), (line), (func))
+#define region_alloc_aligned_loc(r, size_bytes, alignment, file, line, func) alloc_trace_region((r), (region_alloc_aligned)((r), (size_bytes), (alignment)), (size_bytes), (file), (line), (func))
+#else
+#define alloc_trace_region_name(r, name) ((void) (r), (void) (name))
+#define region_alloc_loc(r, size_bytes, file, line, func) ((void) (file), (void) (line), (void) (func), (region_alloc)((r), (size_bytes)))
+#define region_alloc_aligned_loc(r, size_bytes, alignment, file, line, func) ((void) (file), (void) (line), (void) (func), (region_alloc_aligned)((r), (size_bytes), (alignment)))
+#endif // NN_TRACE_ALLOC
 
 typedef struct {
     size_t rows;
     size_t cols;
+    size_t stride; // distance between the beginnings of the rows, in floats
     float *elements;
 } Mat;
 
@@ -88,9 +249,13 @@ Row row_slice(Row row, size_t i, size_t cols);
 #define row_print(row, name, padding) mat_print(row_as_mat(row), name, padding)
 #define row_copy(dst, src) mat_copy(row_as_mat(dst), row_as_mat(src))
 
-#define MAT_AT(m, i, j) (m).elements[(i)*(m).cols + (j)]
+#define MAT_AT(m, i, j) (m).elements[(i)*(m).stride + (j)]
+#define MAT_STRIDE(cols) (((cols) + NN_MAT_PAD - 1)/NN_MAT_PAD*NN_MAT_PAD)
 
-Mat mat_alloc(Region *r, size_t rows, size_t cols);
+// The allocators of matrices and models take the location of their caller, so
+// NN_TRACE_ALLOC attributes the memory to the user code instead of nn.h
+Mat mat_alloc_loc(Region *r, size_t rows, size_t cols, const char *file, int line, const char *func);
+#define mat_alloc(r, rows, cols) mat_alloc_loc((r), (rows), (cols), __FILE__, __LINE__, __func__)
 void mat_fill(Mat m, float x);
 void mat_rand(Mat m, float low, float high);
 Row mat_row(Mat m, size_t row);
@@ -108,6 +273,10 @@ typedef struct {
     Mat *ws; // The amount of activations is arch_count-1
     Row *bs; // The amount of activations is arch_count-1
 
+    // Bumped by every function of nn.h that changes ws or bs. Shared by the
+    // copies of the NN, so (version, *version) identifies its parameters.
+    uint64_t *version;
+
     // TODO: maybe remove these? It would be better to allocate them in a
     // temporary region during the actual forwarding
     Row *as;
@@ -116,7 +285,8 @@ typedef struct {
 #define NN_INPUT(nn) (NN_ASSERT((nn).arch_count > 0), (nn).as[0])
 #define NN_OUTPUT(nn) (NN_ASSERT((nn).arch_count > 0), (nn).as[(nn).arch_count-1])
 
-NN nn_alloc(Region *r, size_t *arch, size_t arch_count);
+NN nn_alloc_loc(Region *r, size_t *arch, size_t arch_count, const char *file, int line, const char *func);
+#define nn_alloc(r, arch, arch_count) nn_alloc_loc((r), (arch), (arch_count), __FILE__, __LINE__, __func__)
 void nn_zero(NN nn);
 void nn_print(NN nn, const char *name);
 #define NN_PRINT(nn) nn_print(nn, #nn);
@@ -125,10 +295,20 @@ void nn_rand(NN nn, float low, float high);
 //
 // Something more like `Mat nn_forward(NN nn, Mat in)`
 void nn_forward(NN nn);
+// Forwards every row of in as one blocked matrix product per layer, returns
+// the rows of the output layer. The activations are allocated in r and nn.as is not touched, so several threads
+// may forward the same NN at once as long as each of them has its own region.
+Mat nn_forward_batch(Region *r, NN nn, Mat in);
+// Same as nn_forward_batch() but in holds the activations of the given layer
+// (0 is the input layer) and only the layers after it are forwarded
+Mat nn_forward_batch_from(Region *r, NN nn, Mat in, size_t layer);
 float nn_cost(NN nn, Mat t);
 NN nn_finite_diff(Region *r, NN nn, Mat t, float eps);
 NN nn_backprop(Region *r, NN nn, Mat t);
 void nn_learn(NN nn, NN g, float rate);
+// Code that writes ws or bs directly calls nn_touch() afterwards
+void nn_touch(NN nn);
+uint64_t nn_version(NN nn);
 
 typedef struct {
     size_t begin;
@@ -138,10 +318,393 @@ typedef struct {
 
 void batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Mat t, float rate);
 
+// Runs training steps until a deadline instead of a fixed number of them, so
+// the amount of training adapts to the architecture and the machine:
+//
+//   train_for_ns(&tb, 5*1000*1000);
+//   while (train_budget_next(&tb)) {
+//       batch_process(...);
+//   }
+//
+// A step is only started if the estimate of its duration, an EWMA of the
+// durations of the previous steps, still fits before the deadline. The first
+// step after train_for_ns() always starts, so training keeps going (and the
+// estimate keeps up) even when the budget is too small for a single step. The
+// estimate is kept across train_for_ns() calls.
+typedef struct {
+    uint64_t deadline_ns;
+    uint64_t step_start_ns; // 0 if no step is running
+    float step_ns;          // EWMA of the duration of a step, 0 - no estimate yet
+    size_t steps;           // started since train_for_ns()
+} Train_Budget;
+
+// Monotonic clock in nanoseconds
+uint64_t nn_now_ns(void);
+void train_for_ns(Train_Budget *tb, uint64_t budget_ns);
+// Measures the previous step and returns true if the next one fits
+bool train_budget_next(Train_Budget *tb);
+
+typedef void (*Pool_Task)(void *arg, size_t index, size_t worker);
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool *pool;
+    size_t index;
+    pthread_t thread;
+    Region scratch;
+} Pool_Worker;
+
+// Fixed set of worker threads executing parallel for loops. The Pool must not
+// be moved after pool_init() and only one pool_run() may be active at a time.
+struct Pool {
+    size_t workers_count;
+    Pool_Worker *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    Pool_Task task;
+    void *arg;
+    size_t next;
+    size_t count;
+    size_t running;
+    bool quit;
+};
+
+// workers_count == 0 starts one worker per online CPU
+bool pool_init(Pool *p, size_t workers_count);
+// Calls task(arg, i, worker) for every i in [0, count) on the workers and
+// waits for all of them to finish. worker is in [0, workers_count) and can be
+// used to index per worker state. If p is NULL the loop runs on the caller.
+void pool_run(Pool *p, size_t count, Pool_Task task, void *arg);
+void pool_free(Pool *p);
+// Scratch region owned by the worker, only valid inside of a task running on
+// it. Every worker creates its own mmap-backed region, so the pages are first
+// touched and therefore placed by the thread that uses them. The region is
+// rewound after every task, allocations need no locking and no freeing. With
+// p == NULL it is the scratch region of the calling thread: the one of the
+// worker inside of a task, otherwise a region created on the first call and
+// freed when the thread exits.
+Region *pool_scratch(Pool *p, size_t worker);
+// Frees the region pool_scratch(NULL, 0) created for the calling thread, for
+// threads that outlive their use of it, e.g. the main thread. Must not be
+// called inside of a task.
+void pool_scratch_release(void);
+
+// Binary model format:
+//   header (magic, version, activation config, arch_count, blob location)
+//   arch (arch_count of uint64_t)
+//   optional extra record (see Checkpoint_Record)
+//   zero padding up to the next NN_FILE_ALIGN boundary
+//   parameters (ws then bs of every layer as dense float32 rows)
+#define NN_FILE_MAGIC "NN.H"
+#define NN_FILE_VERSION 1
+#define NN_FILE_ALIGN 4096
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t act;
+    float relu_param;
+    uint64_t arch_count;
+    uint64_t params_offset;
+    uint64_t params_count;
+} NN_File_Header;
+
+size_t nn_param_count(NN nn);
+// Copy all the parameters of the model from/to a flat array of nn_param_count(nn) floats
+void nn_params_get(NN nn, float *params);
+void nn_params_set(NN nn, const float *params);
+bool nn_save(NN nn, const char *file_path);
+// Allocates the arch and the parameters of the model in the region
+bool nn_load(Region *r, NN *nn, const char *file_path);
+// Maps the parameters of the model read-only straight into ws/bs, only arch
+// and activations are allocated in the region. Processes loading the same file
+// share a single page cache copy of the weights. The mapping lives until the
+// process exits, so the resulting model can be forwarded but not trained.
+bool nn_load_mmap(Region *r, NN *nn, const char *file_path);
+
+// Training monitor is a POSIX shared memory segment (name as for shm_open,
+// e.g. "/nn") the trainer publishes its progress into, for viewers in other
+// processes:
+//   Monitor_Header
+//   arch (arch_count of uint64_t)
+//   cost history (ring of history_cap floats)
+//   parameters (params_count floats, as nn_params_get)
+//
+// The stats with the history and the parameters are guarded by separate
+// seqlocks: the writer makes the sequence number odd, updates the data and
+// makes it even again, a reader copies the data and retries if the number
+// changed in the meantime. The trainer never waits for anybody and does not
+// know how many viewers there are, if any.
+#define MONITOR_MAGIC "NNMN"
+#define MONITOR_VERSION 2
+
+#ifndef MONITOR_HISTORY_CAP
+#define MONITOR_HISTORY_CAP (64*1024)
+#endif // MONITOR_HISTORY_CAP
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t size; // of the whole segment in bytes
+    uint64_t arch_count;
+    uint64_t params_count;
+    uint64_t history_cap;
+    uint64_t arch_offset;
+    uint64_t history_offset;
+    uint64_t params_offset;
+    _Atomic uint32_t closed; // set when the trainer is done with the segment
+    uint64_t pid; // of the trainer, to tell a crashed one from a running one
+
+    _Atomic uint64_t stats_seq;
+    uint64_t epoch;
+    uint64_t samples;
+    float rate;
+    float samples_per_sec;
+    float cost;
+    uint64_t history_count; // costs pushed so far, the last history_cap are kept
+
+    _Atomic uint64_t params_seq; // params_seq/2 is the number of published snapshots
+} Monitor_Header;
+
+typedef struct {
+    size_t epoch;
+    size_t samples;        // trained so far
+    float rate;
+    float samples_per_sec;
+    float cost;            // of the last epoch
+    size_t history_count;  // ignored by monitor_publish_stats()
+} Monitor_Stats;
+
+typedef struct {
+    Monitor_Header *header;
+    size_t size;
+    const char *name;
+    bool owner;
+    uint64_t ino; // to notice that the name was given to a new segment
+} Monitor;
+
+// Trainer side
+// Refuses to replace a segment of a trainer that is still running
+bool monitor_create(Monitor *m, const char *name, NN nn);
+void monitor_publish_stats(Monitor *m, Monitor_Stats stats);
+void monitor_push_cost(Monitor *m, float cost);
+void monitor_publish_params(Monitor *m, NN nn);
+// Marks the segment closed and unlinks it (trainer), unmaps it (viewer)
+void monitor_close(Monitor *m);
+
+// Viewer side
+bool monitor_attach(Monitor *m, const char *name);
+// True if the trainer closed the segment or a new trainer created another one
+// under the same name, the viewer should attach again
+bool monitor_stale(const Monitor *m);
+// Allocates an NN with the arch of the trainer for monitor_read_params()
+NN monitor_nn_alloc(Region *r, const Monitor *m);
+// Copies the stats and the costs pushed after the first `since` ones, oldest
+// first, into history (history_cap floats, may be NULL). Only the last
+// history_cap costs are kept, so fewer may be copied than were pushed since.
+// Returns false if no consistent copy could be made, e.g. the trainer died
+// while writing.
+bool monitor_read_stats(const Monitor *m, Monitor_Stats *stats, size_t since, float *history, size_t *history_count);
+// Copies the parameters into nn if a snapshot newer than *version was
+// published since, returns true if it did
+bool monitor_read_params(const Monitor *m, NN nn, uint64_t *version);
+
+// Set of equally sized 8 bit grayscale images with labels
+#define IMAGE_SET_MAGIC "NNIS"
+#define IMAGE_SET_VERSION 1
+#define IMAGE_SET_LABEL_NAME_CAP 64
+
+typedef struct {
+    size_t count;
+    size_t width;
+    size_t height;
+    uint8_t *pixels; // count images of width*height pixels each
+    uint8_t *labels;
+    size_t label_count;
+    char (*label_names)[IMAGE_SET_LABEL_NAME_CAP];
+    uint64_t fingerprint; // Of the source files the set was decoded from
+} Image_Set;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint64_t width;
+    uint64_t height;
+    uint64_t label_count;
+    uint64_t fingerprint;
+} Image_Set_Header;
+
+#define IMAGE_SET_AT(set, i) (NN_ASSERT((i) < (set).count), &(set).pixels[(i)*(set).width*(set).height])
+
+// Decoded sets are cached as header, label names, labels and pixels
+bool image_set_save(Image_Set set, const char *file_path);
+bool image_set_load(Region *r, Image_Set *set, const char *file_path);
+// Recursively scans dir_path for *.png files. The label of an image is the
+// index of the top level subdirectory it is in (subdirectories are sorted by
+// name), files directly in dir_path are ignored. The images are decoded with
+// stb_image on the pool, so stb_image.h has to be included before the
+// implementation of nn.h. If cache_path is not NULL the decoded set is saved
+// there and reused as long as the paths, sizes and mtimes of the files match.
+bool image_set_load_dir(Region *r, Image_Set *set, const char *dir_path, const char *cache_path, Pool *pool);
+// Maps the standard MNIST IDX files (train-images-idx3-ubyte and
+// train-labels-idx1-ubyte) read-only, the pixels and the labels of the set
+// point straight into the mappings. labels_path may be NULL. Only the label
+// names are allocated in the region.
+bool image_set_load_idx(Region *r, Image_Set *set, const char *images_path, const char *labels_path);
+
+typedef enum {
+    DATASET_MAT,
+    DATASET_IMAGE_SET,
+    DATASET_COLUMNS,
+    DATASET_IMAGE_COORDS,
+} Dataset_Kind;
+
+typedef enum {
+    COLUMN_F32,
+    COLUMN_F16,
+    COLUMN_U8,
+} Column_Type;
+
+// count consecutive columns stored as type, the float value of a column is
+// stored*scale + offset
+typedef struct {
+    Column_Type type;
+    size_t count;
+    float scale;
+    float offset;
+} Dataset_Column;
+
+typedef struct {
+    uint8_t *pixels;
+    size_t width;
+    size_t height;
+} Dataset_Image;
+
+// Source of training samples that are gathered into a float Mat batch by
+// batch. DATASET_MAT rows are used as they are. DATASET_IMAGE_SET keeps the
+// pixels as uint8 and converts them to [0, 1] floats on the fly, the outputs
+// are the one hot encoded labels. DATASET_COLUMNS stores packed rows of
+// typed columns (see Dataset_Column) and converts them on the fly.
+// DATASET_IMAGE_COORDS has a row per pixel of the images: the inputs
+// x/(width - 1), y/(height - 1) and the index of the image are synthesized
+// from the row index, only the uint8 pixels are stored for the output.
+//
+// DATASET_MAT is shuffled by moving its rows, the rest are visited in the
+// order of a random permutation keyed by shuffle, so no per row memory is
+// needed for it.
+typedef struct {
+    Dataset_Kind kind;
+    size_t rows;
+    size_t cols;
+    Mat mat;
+    Image_Set images;
+    Dataset_Column *columns;
+    size_t columns_count;
+    size_t stride; // Bytes per row of data
+    uint8_t *data;
+    Dataset_Image *coords_images;
+    size_t *coords_offsets; // Index of the first row of every image
+    size_t coords_images_count;
+    uint64_t shuffle; // 0 for the natural order
+    size_t shuffle_half_bits;
+} Dataset;
+
+Dataset dataset_from_mat(Mat t);
+Dataset dataset_from_image_set(Image_Set set);
+// Allocates the image table in the region, the pixels are not copied
+Dataset dataset_from_image_coords(Region *r, const Dataset_Image *images, size_t images_count);
+// Allocates the rows in the region, columns are copied
+Dataset dataset_alloc_columns(Region *r, size_t rows, const Dataset_Column *columns, size_t columns_count);
+// Raw storage of a column of DATASET_COLUMNS, for filling it up directly
+void *dataset_at(Dataset ds, size_t row, size_t col);
+// Encodes the value into the type of the column
+void dataset_set(Dataset ds, size_t row, size_t col, float x);
+void dataset_shuffle(Dataset *ds);
+// Gathers the samples [begin, begin + count) of the dataset into a float
+// matrix. Contiguous DATASET_MAT rows are returned as a view without copying.
+Mat dataset_gather(Region *r, Dataset ds, size_t begin, size_t count);
+void dataset_batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Dataset ds, float rate);
+// Gathers the dataset batch by batch, so the temporary memory stays bounded
+float dataset_cost(Region *r, NN nn, Dataset ds);
+
+// Training checkpoint is a regular model file (loadable by nn_load) with the
+// Checkpoint_Record stored between the arch and the parameters.
+//
+// checkpoint_save() only copies the parameters into a staging buffer, the
+// file is written by a background thread into file_path.tmp and atomically
+// renamed. If full_every > 1 only every full_every-th checkpoint is written
+// in full, the ones in between go into file_path.delta as the XOR against
+// the last full checkpoint, split into byte planes and zero run-length
+// encoded, which is a fraction of the full size for slowly changing weights.
+#define CHECKPOINT_MAGIC "CKPT"
+#define CHECKPOINT_DELTA_MAGIC "CKPD"
+
+typedef struct {
+    char magic[4];
+    uint32_t batch_finished;
+    uint64_t id; // For delta: the id of the full checkpoint it was encoded against
+    uint64_t epoch;
+    uint64_t rand_state;
+    uint64_t batch_begin;
+    float batch_cost;
+    uint64_t delta_size;
+    uint64_t shuffle; // the order of the dataset, see Dataset
+    uint64_t shuffle_half_bits;
+} Checkpoint_Record;
+
+typedef struct {
+    const char *file_path;
+    size_t full_every;
+    const size_t *arch;
+    size_t arch_count;
+    size_t params_count;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool pending;
+    bool quit;
+    Checkpoint_Record record;
+    float *staging;
+
+    // Owned by the writer thread
+    size_t written;
+    uint64_t full_id;
+    float *base;
+    uint8_t *delta;
+} Checkpoint;
+
+bool checkpoint_begin(Checkpoint *cp, NN nn, const char *file_path, size_t full_every);
+// Returns false and skips the checkpoint if the previous one is still being written
+bool checkpoint_save(Checkpoint *cp, NN nn, Dataset ds, Batch batch, size_t epoch);
+// Waits for the pending checkpoint to be written and stops the writer thread
+void checkpoint_end(Checkpoint *cp);
+// Restores the parameters, the order of the dataset, the batch, the epoch and
+// the random state. The order of a DATASET_MAT lives in its rows and is not
+// restored, it is shuffled again instead.
+bool checkpoint_load(NN nn, Dataset *ds, Batch *batch, size_t *epoch, const char *file_path);
+
+float f16_to_f32(uint16_t h);
+uint16_t f32_to_f16(float f);
+
 #endif // NN_H_
 
 #ifdef NN_IMPLEMENTATION
 
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+
 float sigmoidf(float x)
 {
     return 1.f / (1.f + expf(-x));
@@ -183,18 +746,45 @@ float dactf(float y, Act act)
     return 0.0f;
 }
 
+static uint64_t nn_rand_state = 0x853c49e6748fea9bULL;
+
+void rand_seed(uint64_t state)
+{
+    nn_rand_state = state;
+}
+
+uint64_t rand_state(void)
+{
+    return nn_rand_state;
+}
+
+// splitmix64
+uint64_t rand_u64(void)
+{
+    uint64_t z = (nn_rand_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 float rand_float(void)
 {
-    return (float) rand() / (float) RAND_MAX;
+    return (float) (rand_u64() >> 40) / (float) (1 << 24);
 }
 
-Mat mat_alloc(Region *r, size_t rows, size_t cols)
+Mat mat_alloc_loc(Region *r, size_t rows, size_t cols, const char *file, int line, const char *func)
 {
     Mat m;
     m.rows = rows;
     m.cols = cols;
-    m.elements = region_alloc(r, sizeof(*m.elements)*rows*cols);
+    m.stride = MAT_STRIDE(cols);
+    m.elements = region_alloc_aligned_loc(r, sizeof(*m.elements)*rows*m.stride, NN_MAT_ALIGN, file, line, func);
     NN_ASSERT(m.elements != NULL);
+    if (m.stride > cols) {
+        for (size_t i = 0; i < rows; ++i) {
+            memset(&MAT_AT(m, i, cols), 0, sizeof(*m.elements)*(m.stride - cols));
+        }
+    }
     return m;
 }
 
@@ -285,7 +875,7 @@ void mat_rand(Mat m, float low, float high)
     }
 }
 
-NN nn_alloc(Region *r, size_t *arch, size_t arch_count)
+NN nn_alloc_loc(Region *r, size_t *arch, size_t arch_count, const char *file, int line, const char *func)
 {
     NN_ASSERT(arch_count > 0);
 
@@ -293,18 +883,21 @@ NN nn_alloc(Region *r, size_t *arch, size_t arch_count)
     nn.arch = arch;
     nn.arch_count = arch_count;
 
-    nn.ws = region_alloc(r, sizeof(*nn.ws)*(nn.arch_count - 1));
+    nn.ws = region_alloc_loc(r, sizeof(*nn.ws)*(nn.arch_count - 1), file, line, func);
     NN_ASSERT(nn.ws != NULL);
-    nn.bs = region_alloc(r, sizeof(*nn.bs)*(nn.arch_count - 1));
+    nn.bs = region_alloc_loc(r, sizeof(*nn.bs)*(nn.arch_count - 1), file, line, func);
     NN_ASSERT(nn.bs != NULL);
-    nn.as = region_alloc(r, sizeof(*nn.as)*nn.arch_count);
+    nn.as = region_alloc_loc(r, sizeof(*nn.as)*nn.arch_count, file, line, func);
     NN_ASSERT(nn.as != NULL);
+    nn.version = region_alloc_loc(r, sizeof(*nn.version), file, line, func);
+    NN_ASSERT(nn.version != NULL);
+    *nn.version = 0;
 
-    nn.as[0] = row_alloc(r, arch[0]);
+    nn.as[0] = mat_row(mat_alloc_loc(r, 1, arch[0], file, line, func), 0);
     for (size_t i = 1; i < arch_count; ++i) {
-        nn.ws[i-1] = mat_alloc(r, nn.as[i-1].cols, arch[i]);
-        nn.bs[i-1] = row_alloc(r, arch[i]);
-        nn.as[i]   = row_alloc(r, arch[i]);
+        nn.ws[i-1] = mat_alloc_loc(r, nn.as[i-1].cols, arch[i], file, line, func);
+        nn.bs[i-1] = mat_row(mat_alloc_loc(r, 1, arch[i], file, line, func), 0);
+        nn.as[i]   = mat_row(mat_alloc_loc(r, 1, arch[i], file, line, func), 0);
     }
 
     return nn;
@@ -318,6 +911,7 @@ void nn_zero(NN nn)
         row_fill(nn.as[i], 0);
     }
     row_fill(nn.as[nn.arch_count - 1], 0);
+    nn_touch(nn);
 }
 
 void nn_print(NN nn, const char *name)
@@ -339,15 +933,118 @@ void nn_rand(NN nn, float low, float high)
         mat_rand(nn.ws[i], low, high);
         row_rand(nn.bs[i], low, high);
     }
+    nn_touch(nn);
+}
+
+// dst = act(src*w + b)
+//
+// When the stride of w is a multiple of NN_MAT_PAD the inner loop goes over the
+// whole padded width in groups of NN_MAT_PAD lanes. dst comes from row_alloc()
+// in that case, so it is padded the same way as w. The padding lanes of dst
+// are cleared afterwards to keep them zeroed.
+static void nn_forward_layer(Row dst, Row src, Mat w, Row b)
+{
+    NN_ASSERT(src.cols == w.rows);
+    NN_ASSERT(dst.cols == w.cols);
+    NN_ASSERT(b.cols == w.cols);
+
+    if (w.stride%NN_MAT_PAD != 0 || w.stride != MAT_STRIDE(w.cols)) {
+        mat_dot(row_as_mat(dst), row_as_mat(src), w);
+        mat_sum(row_as_mat(dst), row_as_mat(b));
+        mat_act(row_as_mat(dst));
+        return;
+    }
+
+    float *y = dst.elements;
+    for (size_t j = 0; j < w.stride; ++j) y[j] = 0;
+    for (size_t k = 0; k < src.cols; ++k) {
+        float a = ROW_AT(src, k);
+        const float *x = &MAT_AT(w, k, 0);
+        for (size_t j = 0; j < w.stride; j += NN_MAT_PAD) {
+            for (size_t l = 0; l < NN_MAT_PAD; ++l) {
+                y[j + l] += a*x[j + l];
+            }
+        }
+    }
+    for (size_t j = 0; j < w.cols; ++j) {
+        y[j] = actf(y[j] + ROW_AT(b, j), NN_ACT);
+    }
+    for (size_t j = w.cols; j < w.stride; ++j) y[j] = 0;
 }
 
 void nn_forward(NN nn)
 {
     for (size_t i = 0; i < nn.arch_count-1; ++i) {
-        mat_dot(row_as_mat(nn.as[i+1]), row_as_mat(nn.as[i]), nn.ws[i]);
-        mat_sum(row_as_mat(nn.as[i+1]), row_as_mat(nn.bs[i]));
-        mat_act(row_as_mat(nn.as[i+1]));
+        nn_forward_layer(nn.as[i+1], nn.as[i], nn.ws[i], nn.bs[i]);
+    }
+}
+
+Mat nn_forward_batch(Region *r, NN nn, Mat in)
+{
+    return nn_forward_batch_from(r, nn, in, 0);
+}
+
+// Adds the block of a rows x c columns of a*w starting at (i0, j0) into acc.
+// Every row of w is loaded once for the whole block of rows and the block
+// of y stays in acc (registers for the fixed size blocks) for all of w.rows.
+#define NN_FORWARD_BLOCK(acc, a, w, i0, j0, block_rows, block_cols)    \
+    for (size_t k = 0; k < (w).rows; ++k) {                            \
+        const float *x = &MAT_AT(w, k, j0);                            \
+        float ak[NN_FORWARD_BLOCK_ROWS];                               \
+        for (size_t r = 0; r < (block_rows); ++r) {                    \
+            ak[r] = MAT_AT(a, (i0) + r, k);                            \
+        }                                                              \
+        for (size_t j = 0; j < (block_cols); ++j) {                    \
+            float xj = x[j];                                           \
+            for (size_t r = 0; r < (block_rows); ++r) {                \
+                acc[r][j] += ak[r]*xj;                                 \
+            }                                                          \
+        }                                                              \
+    }
+
+// y = act(a*w + b) for all the rows of a at once, as a matrix product
+// blocked over NN_FORWARD_BLOCK_ROWS rows and NN_FORWARD_BLOCK_COLS columns.
+// The sums are accumulated in the same order as nn_forward_layer().
+static void nn_forward_layer_batch(Mat y, Mat a, Mat w, Row b)
+{
+    NN_ASSERT(a.cols == w.rows);
+    NN_ASSERT(y.rows == a.rows);
+    NN_ASSERT(y.cols == w.cols);
+    NN_ASSERT(b.cols == w.cols);
+
+    for (size_t i0 = 0; i0 < a.rows; i0 += NN_FORWARD_BLOCK_ROWS) {
+        size_t rows = a.rows - i0 < NN_FORWARD_BLOCK_ROWS ? a.rows - i0 : NN_FORWARD_BLOCK_ROWS;
+        for (size_t j0 = 0; j0 < w.cols; j0 += NN_FORWARD_BLOCK_COLS) {
+            size_t cols = w.cols - j0 < NN_FORWARD_BLOCK_COLS ? w.cols - j0 : NN_FORWARD_BLOCK_COLS;
+            float acc[NN_FORWARD_BLOCK_ROWS][NN_FORWARD_BLOCK_COLS] = {0};
+            if (rows == NN_FORWARD_BLOCK_ROWS && cols == NN_FORWARD_BLOCK_COLS) {
+                NN_FORWARD_BLOCK(acc, a, w, i0, j0, NN_FORWARD_BLOCK_ROWS, NN_FORWARD_BLOCK_COLS);
+            } else {
+                NN_FORWARD_BLOCK(acc, a, w, i0, j0, rows, cols);
+            }
+            for (size_t r = 0; r < rows; ++r) {
+                for (size_t j = 0; j < cols; ++j) {
+                    MAT_AT(y, i0 + r, j0 + j) = actf(acc[r][j] + ROW_AT(b, j0 + j), NN_ACT);
+                }
+            }
+        }
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t j = w.cols; j < y.stride; ++j) MAT_AT(y, i0 + r, j) = 0;
+        }
+    }
+}
+
+Mat nn_forward_batch_from(Region *r, NN nn, Mat in, size_t layer)
+{
+    NN_ASSERT(layer < nn.arch_count);
+    NN_ASSERT(in.cols == nn.as[layer].cols);
+    Mat a = in;
+    for (size_t l = layer; l < nn.arch_count-1; ++l) {
+        Mat y = mat_alloc(r, a.rows, nn.ws[l].cols);
+        nn_forward_layer_batch(y, a, nn.ws[l], nn.bs[l]);
+        a = y;
     }
+    return a;
 }
 
 float nn_cost(NN nn, Mat t)
@@ -491,12 +1188,23 @@ void nn_learn(NN nn, NN g, float rate)
             ROW_AT(nn.bs[i], k) -= rate*ROW_AT(g.bs[i], k);
         }
     }
+    nn_touch(nn);
+}
+
+void nn_touch(NN nn)
+{
+    if (nn.version != NULL) *nn.version += 1;
+}
+
+uint64_t nn_version(NN nn)
+{
+    return nn.version != NULL ? *nn.version : 0;
 }
 
 void mat_shuffle_rows(Mat m)
 {
     for (size_t i = 0; i < m.rows; ++i) {
-         size_t j = i + rand()%(m.rows - i);
+         size_t j = i + rand_u64()%(m.rows - i);
          if (i != j) {
              for (size_t k = 0; k < m.cols; ++k) {
                  float t = MAT_AT(m, i, k);
@@ -509,34 +1217,56 @@ void mat_shuffle_rows(Mat m)
 
 void batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Mat t, float rate)
 {
-    if (b->finished) {
-        b->finished = false;
-        b->begin = 0;
-        b->cost = 0;
-    }
+    dataset_batch_process(r, b, batch_size, nn, dataset_from_mat(t), rate);
+}
 
-    size_t size = batch_size;
-    if (b->begin + batch_size >= t.rows)  {
-        size = t.rows - b->begin;
-    }
+uint64_t nn_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
 
-    // TODO: introduce similar to row_slice operation but for Mat that will give you subsequence of rows
-    Mat batch_t = {
-        .rows = size,
-        .cols = t.cols,
-        .elements = &MAT_AT(t, b->begin, 0),
-    };
+void train_for_ns(Train_Budget *tb, uint64_t budget_ns)
+{
+    tb->deadline_ns = nn_now_ns() + budget_ns;
+    tb->step_start_ns = 0;
+    tb->steps = 0;
+}
 
-    NN g = nn_backprop(r, nn, batch_t);
-    nn_learn(nn, g, rate);
-    b->cost += nn_cost(nn, batch_t);
-    b->begin += batch_size;
+bool train_budget_next(Train_Budget *tb)
+{
+    uint64_t now = nn_now_ns();
+    if (tb->step_start_ns != 0) {
+        float step_ns = now - tb->step_start_ns;
+        tb->step_ns = tb->step_ns == 0 ? step_ns : tb->step_ns + (step_ns - tb->step_ns)/8;
+    }
 
-    if (b->begin >= t.rows) {
-        size_t batch_count = (t.rows + batch_size - 1)/batch_size;
-        b->cost /= batch_count;
-        b->finished = true;
+    if (tb->steps > 0 && now + (uint64_t) tb->step_ns >= tb->deadline_ns) {
+        tb->step_start_ns = 0;
+        return false;
     }
+    tb->step_start_ns = now;
+    tb->steps += 1;
+    return true;
+}
+
+static Region_Block *region_block_alloc(size_t capacity_words)
+{
+    Region_Block *block = nn_malloc(sizeof(*block) + capacity_words*sizeof(*block->words));
+    NN_ASSERT(block != NULL);
+    block->next = NULL;
+    block->begin = 0;
+    block->capacity = capacity_words;
+    return block;
+}
+
+static void region_use_block(Region *r, Region_Block *block, size_t size)
+{
+    r->current = block;
+    r->capacity = block->capacity;
+    r->words = block->words;
+    r->size = size;
 }
 
 Region region_alloc_alloc(size_t capacity_bytes)
@@ -546,31 +1276,400 @@ Region region_alloc_alloc(size_t capacity_bytes)
     size_t word_size = sizeof(*r.words);
     size_t capacity_words = (capacity_bytes + word_size - 1)/word_size;
 
-    void *words = NN_MALLOC(capacity_words*word_size);
-    NN_ASSERT(words != NULL);
-    r.capacity = capacity_words;
-    r.words = words;
+    r.first = region_block_alloc(capacity_words);
+    r.allocated = capacity_words;
+    region_use_block(&r, r.first, 0);
+    return r;
+}
+
+Region region_alloc_growable(size_t initial_bytes, size_t max_bytes)
+{
+    NN_ASSERT(max_bytes == 0 || initial_bytes <= max_bytes);
+    Region r = region_alloc_alloc(initial_bytes);
+    size_t word_size = sizeof(*r.words);
+    r.max = max_bytes/word_size;
+    r.growable = true;
+    return r;
+}
+
+Region region_alloc_mmap(size_t capacity_bytes)
+{
+    Region r = {0};
+
+    size_t word_size = sizeof(*r.words);
+    size_t capacity_words = (capacity_bytes + word_size - 1)/word_size;
+    size_t mapped = sizeof(Region_Block) + capacity_words*word_size;
+
+    void *data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    NN_ASSERT(data != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+    if (mapped >= 2*1024*1024) madvise(data, mapped, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+
+    Region_Block *block = data;
+    block->next = NULL;
+    block->begin = 0;
+    block->capacity = capacity_words;
+
+    r.first = block;
+    r.allocated = capacity_words;
+    r.mapped = mapped;
+    region_use_block(&r, block, 0);
     return r;
 }
 
-void *region_alloc(Region *r, size_t size_bytes)
+void region_free(Region *r)
+{
+    NN_ASSERT(r != NULL);
+    if (r->mapped > 0) {
+        munmap(r->first, r->mapped);
+        memset(r, 0, sizeof(*r));
+        return;
+    }
+    Region_Block *block = r->first;
+    while (block != NULL) {
+        Region_Block *next = block->next;
+        NN_FREE(block);
+        block = next;
+    }
+    memset(r, 0, sizeof(*r));
+}
+
+// Moves the region to the block after the current one, reusing a retained
+// block when it is big enough and chaining a new one otherwise
+static void *region_alloc_next_block(Region *r, size_t size_words)
+{
+    NN_ASSERT(r->growable && "Region capacity exceeded");
+    if (!r->growable) return NULL;
+
+    Region_Block *current = r->current;
+    Region_Block *next = current->next;
+    if (next == NULL || next->capacity < size_words) {
+        size_t capacity = current->capacity*2;
+        if (capacity < size_words) capacity = size_words;
+        if (r->max > 0) {
+            size_t left = r->max > r->allocated ? r->max - r->allocated : 0;
+            if (capacity > left) capacity = left;
+            NN_ASSERT(capacity >= size_words && "Region max capacity exceeded");
+            if (capacity < size_words) return NULL;
+        }
+
+        // Smaller retained blocks stay chained after the new one
+        Region_Block *block = region_block_alloc(capacity);
+        block->next = next;
+        current->next = block;
+        r->allocated += capacity;
+        next = block;
+    }
+
+    next->begin = current->begin + current->capacity;
+    region_use_block(r, next, size_words);
+    return next->words;
+}
+
+void *(region_alloc)(Region *r, size_t size_bytes)
 {
     if (r == NULL) return NN_MALLOC(size_bytes);
     size_t word_size = sizeof(*r->words);
     size_t size_words = (size_bytes + word_size - 1)/word_size;
 
-    NN_ASSERT(r->size + size_words <= r->capacity);
-    if (r->size + size_words > r->capacity) return NULL;
+    if (r->size + size_words > r->capacity) return region_alloc_next_block(r, size_words);
     void *result = &r->words[r->size];
     r->size += size_words;
     return result;
 }
 
+static void *nn_posix_memalign(size_t size_bytes, size_t alignment)
+{
+    // posix_memalign() wants at least the alignment of a pointer
+    if (alignment < sizeof(void*)) alignment = sizeof(void*);
+    void *result = NULL;
+    if (posix_memalign(&result, alignment, size_bytes) != 0) return NULL;
+    return result;
+}
+
+void *(region_alloc_aligned)(Region *r, size_t size_bytes, size_t alignment)
+{
+    NN_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    if (r == NULL) return NN_MALLOC_ALIGNED(size_bytes, alignment);
+    size_t word_size = sizeof(*r->words);
+    size_t size_words = (size_bytes + word_size - 1)/word_size;
+    if (alignment < word_size) alignment = word_size;
+
+    uintptr_t p = (uintptr_t) &r->words[r->size];
+    size_t pad_words = (alignment - p%alignment)%alignment/word_size;
+    if (r->size + pad_words + size_words > r->capacity) {
+        // Reserve the worst case padding in the new block and give back
+        // whatever was not needed
+        uintptr_t *words = region_alloc_next_block(r, size_words + alignment/word_size - 1);
+        if (words == NULL) return NULL;
+        p = (uintptr_t) words;
+        pad_words = (alignment - p%alignment)%alignment/word_size;
+        r->size = pad_words + size_words;
+        return &words[pad_words];
+    }
+    void *result = &r->words[r->size + pad_words];
+    r->size += pad_words + size_words;
+    return result;
+}
+
+static void region_update_peak(Region *r)
+{
+    size_t position = region_save(r);
+    if (r->peak < position) r->peak = position;
+    if (r->touched < position) r->touched = position;
+    if (r->cycle_peak < position) r->cycle_peak = position;
+}
+
+void region_reset(Region *r)
+{
+    NN_ASSERT(r != NULL);
+    region_update_peak(r);
+    if (r->mapped > 0 && r->touched*sizeof(*r->words) > NN_REGION_MMAP_KEEP) {
+        r->idle_resets = r->cycle_peak*2 < r->touched ? r->idle_resets + 1 : 0;
+        if (r->idle_resets >= NN_REGION_MMAP_RELEASE_AFTER) {
+            // Keeps what the last cycle used, the rest goes back to the OS
+            size_t keep = r->cycle_peak*sizeof(*r->words);
+            if (keep < NN_REGION_MMAP_KEEP) keep = NN_REGION_MMAP_KEEP;
+            size_t page_size = sysconf(_SC_PAGESIZE);
+            uintptr_t begin = (uintptr_t) r->first->words + keep;
+            begin = (begin + page_size - 1)/page_size*page_size;
+            uintptr_t end = (uintptr_t) &r->first->words[r->touched];
+            if (begin < end) madvise((void*) begin, end - begin, MADV_DONTNEED);
+            r->touched = keep/sizeof(*r->words);
+            r->idle_resets = 0;
+        }
+    }
+    r->cycle_peak = 0;
+    region_use_block(r, r->first, 0);
+}
+
+size_t region_occupied_bytes(const Region *r)
+{
+    return region_save(r)*sizeof(*r->words);
+}
+
+size_t region_peak_bytes(const Region *r)
+{
+    NN_ASSERT(r != NULL);
+    size_t position = region_save(r);
+    return (r->peak > position ? r->peak : position)*sizeof(*r->words);
+}
+
+size_t region_capacity_bytes(const Region *r)
+{
+    NN_ASSERT(r != NULL);
+    return r->allocated*sizeof(*r->words);
+}
+
+size_t region_save(const Region *r)
+{
+    NN_ASSERT(r != NULL);
+    return r->current->begin + r->size;
+}
+
+void region_rewind(Region *r, size_t s)
+{
+    NN_ASSERT(r != NULL);
+    NN_ASSERT(s <= region_save(r));
+    region_update_peak(r);
+    Region_Block *block = r->first;
+    while (block != r->current && s >= block->begin + block->capacity) {
+        block = block->next;
+    }
+    region_use_block(r, block, s - block->begin);
+}
+
+#ifdef NN_TRACE_ALLOC
+typedef struct {
+    const char *file;
+    int line;
+    const char *func;
+    size_t count;
+    size_t bytes;
+    size_t heap_count; // NN_MALLOC/NN_REALLOC calls among count
+} Alloc_Trace_Site;
+
+typedef struct {
+    const Region *region;
+    const char *name;
+    size_t peak_bytes;
+    size_t capacity_bytes;
+} Alloc_Trace_Region;
+
+static struct {
+    pthread_mutex_t mutex;
+    Alloc_Trace_Site sites[NN_TRACE_SITES_CAP];
+    size_t sites_count;
+    size_t sites_dropped;
+    Alloc_Trace_Region regions[NN_TRACE_REGIONS_CAP];
+    size_t regions_count;
+
+    size_t count;
+    size_t heap_count;
+    size_t bytes;
+
+    size_t steps;
+    size_t step_begin_count;
+    size_t step_begin_heap_count;
+    size_t step_begin_bytes;
+    size_t last_step_count;
+    size_t last_step_heap_count;
+    size_t last_step_bytes;
+    size_t steady_max_count;      // excluding the first step
+    size_t steady_max_heap_count; // excluding the first step
+} alloc_trace = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Must be called with alloc_trace.mutex locked
+static void alloc_trace_record(size_t size_bytes, bool heap, const char *file, int line, const char *func)
+{
+    alloc_trace.count += 1;
+    alloc_trace.bytes += size_bytes;
+    if (heap) alloc_trace.heap_count += 1;
+
+    Alloc_Trace_Site *site = NULL;
+    for (size_t i = 0; i < alloc_trace.sites_count; ++i) {
+        if (alloc_trace.sites[i].line == line && strcmp(alloc_trace.sites[i].file, file) == 0) {
+            site = &alloc_trace.sites[i];
+            break;
+        }
+    }
+    if (site == NULL) {
+        if (alloc_trace.sites_count >= NN_TRACE_SITES_CAP) {
+            alloc_trace.sites_dropped += 1;
+            return;
+        }
+        site = &alloc_trace.sites[alloc_trace.sites_count++];
+        *site = (Alloc_Trace_Site) {
+            .file = file,
+            .line = line,
+            .func = func,
+        };
+    }
+    site->count += 1;
+    site->bytes += size_bytes;
+    if (heap) site->heap_count += 1;
+}
+
+// Must be called with alloc_trace.mutex locked
+static Alloc_Trace_Region *alloc_trace_find_region(const Region *r)
+{
+    for (size_t i = 0; i < alloc_trace.regions_count; ++i) {
+        if (alloc_trace.regions[i].region == r) return &alloc_trace.regions[i];
+    }
+    if (alloc_trace.regions_count >= NN_TRACE_REGIONS_CAP) return NULL;
+    Alloc_Trace_Region *region = &alloc_trace.regions[alloc_trace.regions_count++];
+    *region = (Alloc_Trace_Region) {
+        .region = r,
+    };
+    return region;
+}
+
+void *alloc_trace_malloc(void *result, size_t size_bytes, const char *file, int line, const char *func)
+{
+    pthread_mutex_lock(&alloc_trace.mutex);
+    alloc_trace_record(size_bytes, true, file, line, func);
+    pthread_mutex_unlock(&alloc_trace.mutex);
+    return result;
+}
+
+void *alloc_trace_region(Region *r, void *result, size_t size_bytes, const char *file, int line, const char *func)
+{
+    pthread_mutex_lock(&alloc_trace.mutex);
+    alloc_trace_record(size_bytes, r == NULL, file, line, func);
+    if (r != NULL) {
+        region_update_peak(r);
+        Alloc_Trace_Region *region = alloc_trace_find_region(r);
+        if (region != NULL) {
+            region->peak_bytes = region_peak_bytes(r);
+            region->capacity_bytes = region_capacity_bytes(r);
+        }
+    }
+    pthread_mutex_unlock(&alloc_trace.mutex);
+    return result;
+}
+
+void alloc_trace_region_name(const Region *r, const char *name)
+{
+    pthread_mutex_lock(&alloc_trace.mutex);
+    Alloc_Trace_Region *region = alloc_trace_find_region(r);
+    if (region != NULL) region->name = name;
+    pthread_mutex_unlock(&alloc_trace.mutex);
+}
+
+void alloc_trace_step(void)
+{
+    pthread_mutex_lock(&alloc_trace.mutex);
+    alloc_trace.last_step_count = alloc_trace.count - alloc_trace.step_begin_count;
+    alloc_trace.last_step_heap_count = alloc_trace.heap_count - alloc_trace.step_begin_heap_count;
+    alloc_trace.last_step_bytes = alloc_trace.bytes - alloc_trace.step_begin_bytes;
+    if (alloc_trace.steps > 0) {
+        if (alloc_trace.steady_max_count < alloc_trace.last_step_count) {
+            alloc_trace.steady_max_count = alloc_trace.last_step_count;
+        }
+        if (alloc_trace.steady_max_heap_count < alloc_trace.last_step_heap_count) {
+            alloc_trace.steady_max_heap_count = alloc_trace.last_step_heap_count;
+        }
+    }
+    alloc_trace.steps += 1;
+    alloc_trace.step_begin_count = alloc_trace.count;
+    alloc_trace.step_begin_heap_count = alloc_trace.heap_count;
+    alloc_trace.step_begin_bytes = alloc_trace.bytes;
+    pthread_mutex_unlock(&alloc_trace.mutex);
+}
+
+static int alloc_trace_site_compare(const void *a, const void *b)
+{
+    const Alloc_Trace_Site *sa = a;
+    const Alloc_Trace_Site *sb = b;
+    if (sa->bytes != sb->bytes) return sa->bytes < sb->bytes ? 1 : -1;
+    return sa->count < sb->count ? 1 : sa->count > sb->count ? -1 : 0;
+}
+
+void alloc_trace_report(FILE *stream)
+{
+    pthread_mutex_lock(&alloc_trace.mutex);
+    fprintf(stream, "Allocations: %zu (%zu heap), %zu bytes\n", alloc_trace.count, alloc_trace.heap_count, alloc_trace.bytes);
+    if (alloc_trace.steps > 0) {
+        fprintf(stream, "Steps: %zu, last step: %zu allocations (%zu heap), %zu bytes\n",
+                alloc_trace.steps, alloc_trace.last_step_count, alloc_trace.last_step_heap_count, alloc_trace.last_step_bytes);
+        fprintf(stream, "Steady state (all steps but the first): at most %zu allocations (%zu heap) per step\n",
+                alloc_trace.steady_max_count, alloc_trace.steady_max_heap_count);
+    }
+
+    qsort(alloc_trace.sites, alloc_trace.sites_count, sizeof(*alloc_trace.sites), alloc_trace_site_compare);
+    fprintf(stream, "Sites:\n");
+    fprintf(stream, "    %12s %12s %16s  %s\n", "count", "heap", "bytes", "site");
+    for (size_t i = 0; i < alloc_trace.sites_count; ++i) {
+        Alloc_Trace_Site *site = &alloc_trace.sites[i];
+        fprintf(stream, "    %12zu %12zu %16zu  %s:%d (%s)\n", site->count, site->heap_count, site->bytes, site->file, site->line, site->func);
+    }
+    if (alloc_trace.sites_dropped > 0) {
+        fprintf(stream, "    %12zu allocations from sites past NN_TRACE_SITES_CAP\n", alloc_trace.sites_dropped);
+    }
+
+    fprintf(stream, "Regions:\n");
+    fprintf(stream, "    %16s %16s  %s\n", "peak", "capacity", "region");
+    for (size_t i = 0; i < alloc_trace.regions_count; ++i) {
+        Alloc_Trace_Region *region = &alloc_trace.regions[i];
+        if (region->name != NULL) {
+            fprintf(stream, "    %16zu %16zu  %s\n", region->peak_bytes, region->capacity_bytes, region->name);
+        } else {
+            fprintf(stream, "    %16zu %16zu  %p\n", region->peak_bytes, region->capacity_bytes, (const void *) region->region);
+        }
+    }
+    pthread_mutex_unlock(&alloc_trace.mutex);
+}
+#endif // NN_TRACE_ALLOC
+
 Mat row_as_mat(Row row)
 {
     return (Mat) {
         .rows = 1,
         .cols = row.cols,
+        .stride = row.cols,
         .elements = row.elements,
     };
 }
@@ -585,4 +1684,1854 @@ Row row_slice(Row row, size_t i, size_t size)
     };
 }
 
+size_t nn_param_count(NN nn)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < nn.arch_count-1; ++i) {
+        count += nn.ws[i].rows*nn.ws[i].cols + nn.bs[i].cols;
+    }
+    return count;
+}
+
+void nn_params_get(NN nn, float *params)
+{
+    for (size_t i = 0; i < nn.arch_count-1; ++i) {
+        for (size_t j = 0; j < nn.ws[i].rows; ++j) {
+            memcpy(params, &MAT_AT(nn.ws[i], j, 0), sizeof(float)*nn.ws[i].cols);
+            params += nn.ws[i].cols;
+        }
+        memcpy(params, nn.bs[i].elements, sizeof(float)*nn.bs[i].cols);
+        params += nn.bs[i].cols;
+    }
+}
+
+void nn_params_set(NN nn, const float *params)
+{
+    for (size_t i = 0; i < nn.arch_count-1; ++i) {
+        for (size_t j = 0; j < nn.ws[i].rows; ++j) {
+            memcpy(&MAT_AT(nn.ws[i], j, 0), params, sizeof(float)*nn.ws[i].cols);
+            params += nn.ws[i].cols;
+        }
+        memcpy(nn.bs[i].elements, params, sizeof(float)*nn.bs[i].cols);
+        params += nn.bs[i].cols;
+    }
+    nn_touch(nn);
+}
+
+// Writes everything up to the parameter blob, extra goes right after the arch
+static void nn_file_write_header(FILE *f, const size_t *arch, size_t arch_count, size_t params_count, const void *extra, size_t extra_size)
+{
+    size_t arch_end = sizeof(NN_File_Header) + arch_count*sizeof(uint64_t) + extra_size;
+    NN_File_Header h = {0};
+    memcpy(h.magic, NN_FILE_MAGIC, sizeof(h.magic));
+    h.version = NN_FILE_VERSION;
+    h.act = NN_ACT;
+    h.relu_param = NN_RELU_PARAM;
+    h.arch_count = arch_count;
+    h.params_offset = (arch_end + NN_FILE_ALIGN - 1)/NN_FILE_ALIGN*NN_FILE_ALIGN;
+    h.params_count = params_count;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (size_t i = 0; i < arch_count; ++i) {
+        uint64_t x = arch[i];
+        fwrite(&x, sizeof(x), 1, f);
+    }
+
+    if (extra_size > 0) fwrite(extra, extra_size, 1, f);
+
+    for (size_t i = arch_end; i < h.params_offset; ++i) {
+        fputc(0, f);
+    }
+}
+
+static bool nn_file_close(FILE *f, const char *file_path, bool sync)
+{
+    if (ferror(f) || fflush(f) != 0 || (sync && fsync(fileno(f)) < 0)) {
+        fprintf(stderr, "ERROR: could not write file %s: %s\n", file_path, strerror(errno));
+        fclose(f);
+        return false;
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "ERROR: could not write file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool nn_save(NN nn, const char *file_path)
+{
+    FILE *f = fopen(file_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    nn_file_write_header(f, nn.arch, nn.arch_count, nn_param_count(nn), NULL, 0);
+
+    for (size_t i = 0; i < nn.arch_count-1; ++i) {
+        for (size_t j = 0; j < nn.ws[i].rows; ++j) {
+            fwrite(&MAT_AT(nn.ws[i], j, 0), sizeof(float), nn.ws[i].cols, f);
+        }
+        fwrite(nn.bs[i].elements, sizeof(float), nn.bs[i].cols, f);
+    }
+
+    return nn_file_close(f, file_path, false);
+}
+
+static bool nn_file_header_check(const NN_File_Header *h, size_t file_size, const char *file_path)
+{
+    if (file_size < sizeof(*h) || memcmp(h->magic, NN_FILE_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not an nn.h model file\n", file_path);
+        return false;
+    }
+    if (h->version != NN_FILE_VERSION) {
+        fprintf(stderr, "ERROR: %s has unsupported version %u, expected %u\n", file_path, h->version, NN_FILE_VERSION);
+        return false;
+    }
+    if (h->act != NN_ACT || h->relu_param != NN_RELU_PARAM) {
+        fprintf(stderr, "ERROR: %s was trained with a different activation than NN_ACT/NN_RELU_PARAM\n", file_path);
+        return false;
+    }
+    if (h->arch_count < 1 || h->params_offset % NN_FILE_ALIGN != 0 ||
+        h->params_offset < sizeof(*h) + h->arch_count*sizeof(uint64_t) ||
+        h->params_offset + h->params_count*sizeof(float) > file_size) {
+        fprintf(stderr, "ERROR: %s is truncated or corrupted\n", file_path);
+        return false;
+    }
+    return true;
+}
+
+static bool nn_file_arch_check(NN nn, const NN_File_Header *h, const char *file_path)
+{
+    if (nn_param_count(nn) != h->params_count) {
+        fprintf(stderr, "ERROR: %s: parameter count does not match the arch\n", file_path);
+        return false;
+    }
+    return true;
+}
+
+bool nn_load(Region *r, NN *nn, const char *file_path)
+{
+    bool result = true;
+
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    NN_File_Header h = {0};
+    if (fstat(fileno(f), &st) < 0 || fread(&h, sizeof(h), 1, f) != 1) {
+        fprintf(stderr, "ERROR: could not read file %s\n", file_path);
+        result = false;
+        goto defer;
+    }
+    if (!nn_file_header_check(&h, st.st_size, file_path)) {
+        result = false;
+        goto defer;
+    }
+
+    size_t *arch = region_alloc(r, sizeof(*arch)*h.arch_count);
+    NN_ASSERT(arch != NULL);
+    for (size_t i = 0; i < h.arch_count; ++i) {
+        uint64_t x;
+        if (fread(&x, sizeof(x), 1, f) != 1) {
+            fprintf(stderr, "ERROR: could not read arch from %s\n", file_path);
+            result = false;
+            goto defer;
+        }
+        arch[i] = x;
+    }
+
+    NN loaded = nn_alloc(r, arch, h.arch_count);
+    if (!nn_file_arch_check(loaded, &h, file_path)) {
+        result = false;
+        goto defer;
+    }
+
+    if (fseek(f, h.params_offset, SEEK_SET) < 0) {
+        fprintf(stderr, "ERROR: could not read parameters from %s: %s\n", file_path, strerror(errno));
+        result = false;
+        goto defer;
+    }
+    for (size_t i = 0; i < loaded.arch_count-1; ++i) {
+        bool ok = true;
+        for (size_t j = 0; j < loaded.ws[i].rows; ++j) {
+            ok = ok && fread(&MAT_AT(loaded.ws[i], j, 0), sizeof(float), loaded.ws[i].cols, f) == loaded.ws[i].cols;
+        }
+        ok = ok && fread(loaded.bs[i].elements, sizeof(float), loaded.bs[i].cols, f) == loaded.bs[i].cols;
+        if (!ok) {
+            fprintf(stderr, "ERROR: could not read parameters from %s\n", file_path);
+            result = false;
+            goto defer;
+        }
+    }
+
+    *nn = loaded;
+
+defer:
+    fclose(f);
+    return result;
+}
+
+bool nn_load_mmap(Region *r, NN *nn, const char *file_path)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: could not stat file %s: %s\n", file_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if ((size_t) st.st_size < sizeof(NN_File_Header)) {
+        fprintf(stderr, "ERROR: %s is not an nn.h model file\n", file_path);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    const NN_File_Header *h = data;
+    if (!nn_file_header_check(h, st.st_size, file_path)) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    const uint64_t *arch64 = (const uint64_t*)(h + 1);
+    size_t *arch = region_alloc(r, sizeof(*arch)*h->arch_count);
+    NN_ASSERT(arch != NULL);
+    for (size_t i = 0; i < h->arch_count; ++i) {
+        arch[i] = arch64[i];
+    }
+
+    NN loaded;
+    loaded.arch = arch;
+    loaded.arch_count = h->arch_count;
+    loaded.ws = region_alloc(r, sizeof(*loaded.ws)*(loaded.arch_count - 1));
+    NN_ASSERT(loaded.ws != NULL);
+    loaded.bs = region_alloc(r, sizeof(*loaded.bs)*(loaded.arch_count - 1));
+    NN_ASSERT(loaded.bs != NULL);
+    loaded.as = region_alloc(r, sizeof(*loaded.as)*loaded.arch_count);
+    NN_ASSERT(loaded.as != NULL);
+    loaded.version = region_alloc(r, sizeof(*loaded.version));
+    NN_ASSERT(loaded.version != NULL);
+    *loaded.version = 0;
+
+    float *params = (float*)((uint8_t*)data + h->params_offset);
+    loaded.as[0] = row_alloc(r, loaded.arch[0]);
+    for (size_t i = 1; i < loaded.arch_count; ++i) {
+        loaded.ws[i-1] = (Mat) {
+            .rows = loaded.as[i-1].cols,
+            .cols = loaded.arch[i],
+            .stride = loaded.arch[i],
+            .elements = params,
+        };
+        params += loaded.ws[i-1].rows*loaded.ws[i-1].cols;
+        loaded.bs[i-1] = (Row) {
+            .cols = loaded.arch[i],
+            .elements = params,
+        };
+        params += loaded.bs[i-1].cols;
+        loaded.as[i] = row_alloc(r, loaded.arch[i]);
+    }
+
+    if (!nn_file_arch_check(loaded, h, file_path)) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    *nn = loaded;
+    return true;
+}
+
+// Transposes the words into byte planes (the high bytes of the XOR of two
+// close floats are mostly zero) and encodes runs of zero bytes as 0x00 <len>
+static size_t checkpoint_delta_encode(uint8_t *out, const float *params, const float *base, size_t count)
+{
+    size_t size = 0;
+    size_t run = 0;
+    for (size_t plane = 0; plane < sizeof(uint32_t); ++plane) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t a, b;
+            memcpy(&a, &params[i], sizeof(a));
+            memcpy(&b, &base[i], sizeof(b));
+            uint8_t x = ((a ^ b) >> (8*plane)) & 0xFF;
+            if (x == 0) {
+                run += 1;
+                if (run == 0xFF) {
+                    out[size++] = 0;
+                    out[size++] = run;
+                    run = 0;
+                }
+            } else {
+                if (run > 0) {
+                    out[size++] = 0;
+                    out[size++] = run;
+                    run = 0;
+                }
+                out[size++] = x;
+            }
+        }
+    }
+    if (run > 0) {
+        out[size++] = 0;
+        out[size++] = run;
+    }
+    return size;
+}
+
+static bool checkpoint_delta_decode(float *params, const uint8_t *in, size_t size, size_t count)
+{
+    size_t total = count*sizeof(uint32_t);
+    size_t n = 0;
+    for (size_t i = 0; i < size; ++i) {
+        size_t len = 1;
+        uint8_t x = in[i];
+        if (x == 0) {
+            if (i + 1 >= size) return false;
+            len = in[++i];
+        }
+        if (n + len > total) return false;
+        for (; len > 0; --len, ++n) {
+            size_t plane = n/count;
+            uint32_t w;
+            memcpy(&w, &params[n%count], sizeof(w));
+            w ^= (uint32_t) x << (8*plane);
+            memcpy(&params[n%count], &w, sizeof(w));
+        }
+    }
+    return n == total;
+}
+
+// Ids of full checkpoints must not repeat across runs, otherwise a delta left
+// behind by a crash of a previous run could match the new full checkpoint.
+// Wall clock time mixed with the pid, forced to differ from the previous id.
+static uint64_t checkpoint_new_id(uint64_t previous)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x = (uint64_t) ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+    x ^= (uint64_t) getpid() << 40;
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    if (x == 0 || x == previous) x = previous + 1;
+    return x;
+}
+
+static void checkpoint_write(Checkpoint *cp, Checkpoint_Record record)
+{
+    char delta_path[4096];
+    char tmp_path[sizeof(delta_path) + 8];
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", cp->file_path);
+
+    bool full = cp->full_every <= 1 || cp->written%cp->full_every == 0;
+    const char *file_path = full ? cp->file_path : delta_path;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+
+    if (full) {
+        cp->full_id = checkpoint_new_id(cp->full_id);
+        memcpy(record.magic, CHECKPOINT_MAGIC, sizeof(record.magic));
+        record.id = cp->full_id;
+        nn_file_write_header(f, cp->arch, cp->arch_count, cp->params_count, &record, sizeof(record));
+        fwrite(cp->staging, sizeof(float), cp->params_count, f);
+    } else {
+        memcpy(record.magic, CHECKPOINT_DELTA_MAGIC, sizeof(record.magic));
+        record.id = cp->full_id;
+        record.delta_size = checkpoint_delta_encode(cp->delta, cp->staging, cp->base, cp->params_count);
+        fwrite(&record, sizeof(record), 1, f);
+        fwrite(cp->delta, 1, record.delta_size, f);
+    }
+
+    if (!nn_file_close(f, tmp_path, true)) return;
+    if (rename(tmp_path, file_path) < 0) {
+        fprintf(stderr, "ERROR: could not rename %s to %s: %s\n", tmp_path, file_path, strerror(errno));
+        return;
+    }
+
+    if (full && cp->base != NULL) {
+        memcpy(cp->base, cp->staging, sizeof(float)*cp->params_count);
+        // The old delta is stale now. Even if we crash before removing it,
+        // its id won't match the new full checkpoint (see checkpoint_new_id()).
+        unlink(delta_path);
+    }
+    cp->written += 1;
+}
+
+static void *checkpoint_writer(void *arg)
+{
+    Checkpoint *cp = arg;
+    pthread_mutex_lock(&cp->mutex);
+    for (;;) {
+        while (!cp->pending && !cp->quit) {
+            pthread_cond_wait(&cp->cond, &cp->mutex);
+        }
+        if (!cp->pending) break;
+
+        Checkpoint_Record record = cp->record;
+        pthread_mutex_unlock(&cp->mutex);
+        checkpoint_write(cp, record);
+        pthread_mutex_lock(&cp->mutex);
+
+        cp->pending = false;
+        pthread_cond_broadcast(&cp->cond);
+    }
+    pthread_mutex_unlock(&cp->mutex);
+    return NULL;
+}
+
+bool checkpoint_begin(Checkpoint *cp, NN nn, const char *file_path, size_t full_every)
+{
+    memset(cp, 0, sizeof(*cp));
+    cp->file_path = file_path;
+    cp->full_every = full_every;
+    cp->arch = nn.arch;
+    cp->arch_count = nn.arch_count;
+    cp->params_count = nn_param_count(nn);
+
+    cp->staging = nn_malloc(sizeof(float)*cp->params_count);
+    NN_ASSERT(cp->staging != NULL);
+    if (full_every > 1) {
+        cp->base = nn_malloc(sizeof(float)*cp->params_count);
+        NN_ASSERT(cp->base != NULL);
+        // Worst case of the encoding is every zero byte being a run of its own
+        cp->delta = nn_malloc(2*sizeof(float)*cp->params_count);
+        NN_ASSERT(cp->delta != NULL);
+    }
+
+    pthread_mutex_init(&cp->mutex, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+    int err = pthread_create(&cp->thread, NULL, checkpoint_writer, cp);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: could not start checkpoint writer: %s\n", strerror(err));
+        NN_FREE(cp->staging);
+        NN_FREE(cp->base);
+        NN_FREE(cp->delta);
+        return false;
+    }
+    return true;
+}
+
+bool checkpoint_save(Checkpoint *cp, NN nn, Dataset ds, Batch batch, size_t epoch)
+{
+    NN_ASSERT(nn_param_count(nn) == cp->params_count);
+
+    pthread_mutex_lock(&cp->mutex);
+    if (cp->pending) {
+        pthread_mutex_unlock(&cp->mutex);
+        return false;
+    }
+
+    nn_params_get(nn, cp->staging);
+    memset(&cp->record, 0, sizeof(cp->record));
+    cp->record.epoch = epoch;
+    cp->record.rand_state = rand_state();
+    cp->record.batch_begin = batch.begin;
+    cp->record.batch_cost = batch.cost;
+    cp->record.batch_finished = batch.finished;
+    cp->record.shuffle = ds.shuffle;
+    cp->record.shuffle_half_bits = ds.shuffle_half_bits;
+    cp->pending = true;
+    pthread_cond_broadcast(&cp->cond);
+    pthread_mutex_unlock(&cp->mutex);
+    return true;
+}
+
+void checkpoint_end(Checkpoint *cp)
+{
+    pthread_mutex_lock(&cp->mutex);
+    cp->quit = true;
+    pthread_cond_broadcast(&cp->cond);
+    pthread_mutex_unlock(&cp->mutex);
+    pthread_join(cp->thread, NULL);
+
+    pthread_mutex_destroy(&cp->mutex);
+    pthread_cond_destroy(&cp->cond);
+    NN_FREE(cp->staging);
+    NN_FREE(cp->base);
+    NN_FREE(cp->delta);
+}
+
+bool checkpoint_load(NN nn, Dataset *ds, Batch *batch, size_t *epoch, const char *file_path)
+{
+    bool result = true;
+    float *params = NULL;
+    uint8_t *delta = NULL;
+    FILE *df = NULL;
+
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    NN_File_Header h = {0};
+    if (fstat(fileno(f), &st) < 0 || fread(&h, sizeof(h), 1, f) != 1) {
+        fprintf(stderr, "ERROR: could not read file %s\n", file_path);
+        result = false;
+        goto defer;
+    }
+    if (!nn_file_header_check(&h, st.st_size, file_path)) {
+        result = false;
+        goto defer;
+    }
+
+    bool arch_ok = h.arch_count == nn.arch_count && h.params_count == nn_param_count(nn);
+    for (size_t i = 0; i < h.arch_count && arch_ok; ++i) {
+        uint64_t x;
+        arch_ok = fread(&x, sizeof(x), 1, f) == 1 && x == nn.arch[i];
+    }
+    if (!arch_ok) {
+        fprintf(stderr, "ERROR: %s: arch of the checkpoint does not match the model\n", file_path);
+        result = false;
+        goto defer;
+    }
+
+    Checkpoint_Record record;
+    if (fread(&record, sizeof(record), 1, f) != 1 || memcmp(record.magic, CHECKPOINT_MAGIC, sizeof(record.magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is a model file but not a checkpoint\n", file_path);
+        result = false;
+        goto defer;
+    }
+
+    params = nn_malloc(sizeof(float)*h.params_count);
+    NN_ASSERT(params != NULL);
+    if (fseek(f, h.params_offset, SEEK_SET) < 0 || fread(params, sizeof(float), h.params_count, f) != h.params_count) {
+        fprintf(stderr, "ERROR: could not read parameters from %s\n", file_path);
+        result = false;
+        goto defer;
+    }
+
+    char delta_path[4096];
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", file_path);
+    df = fopen(delta_path, "rb");
+    if (df != NULL) {
+        Checkpoint_Record delta_record;
+        if (fread(&delta_record, sizeof(delta_record), 1, df) == 1 &&
+            memcmp(delta_record.magic, CHECKPOINT_DELTA_MAGIC, sizeof(delta_record.magic)) == 0 &&
+            delta_record.id == record.id &&
+            delta_record.delta_size <= 2*sizeof(float)*h.params_count) {
+            delta = nn_malloc(delta_record.delta_size);
+            NN_ASSERT(delta != NULL);
+            if (fread(delta, 1, delta_record.delta_size, df) == delta_record.delta_size &&
+                checkpoint_delta_decode(params, delta, delta_record.delta_size, h.params_count)) {
+                record = delta_record;
+            } else {
+                fprintf(stderr, "ERROR: %s is corrupted\n", delta_path);
+                result = false;
+                goto defer;
+            }
+        }
+    }
+
+    nn_params_set(nn, params);
+    *epoch = record.epoch;
+    batch->begin = record.batch_begin;
+    batch->cost = record.batch_cost;
+    batch->finished = record.batch_finished;
+    rand_seed(record.rand_state);
+    if (ds->kind == DATASET_MAT) {
+        dataset_shuffle(ds);
+    } else {
+        ds->shuffle = record.shuffle;
+        ds->shuffle_half_bits = record.shuffle_half_bits;
+    }
+
+defer:
+    if (df) fclose(df);
+    NN_FREE(delta);
+    NN_FREE(params);
+    fclose(f);
+    return result;
+}
+
+static void monitor_write_begin(_Atomic uint64_t *seq)
+{
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void monitor_write_end(_Atomic uint64_t *seq)
+{
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Returns false if the writer keeps the sequence odd for too long
+static bool monitor_read_begin(_Atomic uint64_t *seq, uint64_t *s)
+{
+    for (size_t i = 0; i < 1000; ++i) {
+        *s = atomic_load_explicit(seq, memory_order_acquire);
+        if (*s%2 == 0) return true;
+        sched_yield();
+    }
+    return false;
+}
+
+static bool monitor_read_end(_Atomic uint64_t *seq, uint64_t s)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) == s;
+}
+
+// True if name is a segment whose trainer neither closed it nor died
+static bool monitor_in_use(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(Monitor_Header)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, sizeof(Monitor_Header), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    Monitor_Header *h = data;
+    bool in_use = false;
+    if (memcmp(h->magic, MONITOR_MAGIC, sizeof(h->magic)) == 0 && h->version == MONITOR_VERSION) {
+        atomic_thread_fence(memory_order_acquire);
+        if (!atomic_load_explicit(&h->closed, memory_order_acquire)) {
+            pid_t pid = (pid_t) h->pid;
+            in_use = pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+        }
+    }
+    munmap(data, sizeof(Monitor_Header));
+    return in_use;
+}
+
+bool monitor_create(Monitor *m, const char *name, NN nn)
+{
+    memset(m, 0, sizeof(*m));
+    size_t params_count = nn_param_count(nn);
+    size_t arch_offset = sizeof(Monitor_Header);
+    size_t history_offset = arch_offset + sizeof(uint64_t)*nn.arch_count;
+    size_t params_offset = history_offset + sizeof(float)*MONITOR_HISTORY_CAP;
+    size_t size = params_offset + sizeof(float)*params_count;
+
+    if (monitor_in_use(name)) {
+        fprintf(stderr, "ERROR: shared memory %s is used by a running trainer\n", name);
+        return false;
+    }
+    // A segment left behind by a finished or crashed trainer is replaced, its
+    // viewers notice that through monitor_stale()
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create shared memory %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (ftruncate(fd, size) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: could not resize shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void *data = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map shared memory %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return false;
+    }
+
+    Monitor_Header *h = data;
+    h->version = MONITOR_VERSION;
+    h->size = size;
+    h->arch_count = nn.arch_count;
+    h->params_count = params_count;
+    h->history_cap = MONITOR_HISTORY_CAP;
+    h->arch_offset = arch_offset;
+    h->history_offset = history_offset;
+    h->params_offset = params_offset;
+    h->pid = (uint64_t) getpid();
+    uint64_t *arch = (uint64_t*)((uint8_t*)data + arch_offset);
+    for (size_t i = 0; i < nn.arch_count; ++i) arch[i] = nn.arch[i];
+    // The magic goes last, so viewers never attach to a half initialized segment
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->magic, MONITOR_MAGIC, sizeof(h->magic));
+
+    m->header = h;
+    m->size = size;
+    m->name = name;
+    m->owner = true;
+    m->ino = st.st_ino;
+    return true;
+}
+
+void monitor_publish_stats(Monitor *m, Monitor_Stats stats)
+{
+    Monitor_Header *h = m->header;
+    monitor_write_begin(&h->stats_seq);
+    h->epoch = stats.epoch;
+    h->samples = stats.samples;
+    h->rate = stats.rate;
+    h->samples_per_sec = stats.samples_per_sec;
+    h->cost = stats.cost;
+    monitor_write_end(&h->stats_seq);
+}
+
+void monitor_push_cost(Monitor *m, float cost)
+{
+    Monitor_Header *h = m->header;
+    float *history = (float*)((uint8_t*)h + h->history_offset);
+    monitor_write_begin(&h->stats_seq);
+    history[h->history_count%h->history_cap] = cost;
+    h->history_count += 1;
+    monitor_write_end(&h->stats_seq);
+}
+
+void monitor_publish_params(Monitor *m, NN nn)
+{
+    Monitor_Header *h = m->header;
+    NN_ASSERT(nn_param_count(nn) == h->params_count);
+    monitor_write_begin(&h->params_seq);
+    nn_params_get(nn, (float*)((uint8_t*)h + h->params_offset));
+    monitor_write_end(&h->params_seq);
+}
+
+void monitor_close(Monitor *m)
+{
+    if (m->header == NULL) return;
+    if (m->owner) {
+        atomic_store_explicit(&m->header->closed, 1, memory_order_release);
+        shm_unlink(m->name);
+    }
+    munmap(m->header, m->size);
+    m->header = NULL;
+}
+
+// The header comes from another process, so everything derived from it is
+// checked against the size of the mapping before it is dereferenced
+static bool monitor_layout_valid(const Monitor_Header *h, size_t size)
+{
+    if (h->arch_count < 2 || h->arch_count > size/sizeof(uint64_t)) return false;
+    if (h->history_cap == 0 || h->history_cap > size/sizeof(float)) return false;
+    if (h->params_count > size/sizeof(float)) return false;
+
+    if (h->arch_offset < sizeof(Monitor_Header) || h->arch_offset%sizeof(uint64_t) != 0) return false;
+    if (h->arch_offset > size || size - h->arch_offset < sizeof(uint64_t)*h->arch_count) return false;
+    if (h->history_offset%sizeof(float) != 0) return false;
+    if (h->history_offset > size || size - h->history_offset < sizeof(float)*h->history_cap) return false;
+    if (h->params_offset%sizeof(float) != 0) return false;
+    if (h->params_offset > size || size - h->params_offset < sizeof(float)*h->params_count) return false;
+
+    // monitor_nn_alloc() builds an NN out of the arch, its parameters have to
+    // be the ones monitor_read_params() copies
+    const uint64_t *arch = (const uint64_t*)((const uint8_t*)h + h->arch_offset);
+    uint64_t params_count = 0;
+    for (size_t i = 0; i < h->arch_count; ++i) {
+        if (arch[i] == 0 || arch[i] > size/sizeof(float)) return false;
+        if (i > 0) {
+            params_count += (arch[i - 1] + 1)*arch[i];
+            if (params_count > h->params_count) return false;
+        }
+    }
+    return params_count == h->params_count;
+}
+
+bool monitor_attach(Monitor *m, const char *name)
+{
+    memset(m, 0, sizeof(*m));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(Monitor_Header)) {
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map shared memory %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    Monitor_Header *h = data;
+    if (memcmp(h->magic, MONITOR_MAGIC, sizeof(h->magic)) != 0) {
+        // Not initialized yet
+        munmap(data, st.st_size);
+        return false;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (h->version != MONITOR_VERSION || h->size != (uint64_t) st.st_size) {
+        fprintf(stderr, "ERROR: %s is not a monitor of version %d\n", name, MONITOR_VERSION);
+        munmap(data, st.st_size);
+        return false;
+    }
+    if (!monitor_layout_valid(h, st.st_size)) {
+        fprintf(stderr, "ERROR: %s is not a valid monitor\n", name);
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    m->header = h;
+    m->size = st.st_size;
+    m->name = name;
+    m->ino = st.st_ino;
+    return true;
+}
+
+bool monitor_stale(const Monitor *m)
+{
+    if (m->header == NULL || atomic_load_explicit(&m->header->closed, memory_order_acquire)) return true;
+    int fd = shm_open(m->name, O_RDONLY, 0);
+    if (fd < 0) return true;
+    struct stat st;
+    bool stale = fstat(fd, &st) < 0 || st.st_ino != m->ino;
+    close(fd);
+    return stale;
+}
+
+NN monitor_nn_alloc(Region *r, const Monitor *m)
+{
+    const Monitor_Header *h = m->header;
+    const uint64_t *arch = (const uint64_t*)((const uint8_t*)h + h->arch_offset);
+    size_t *nn_arch = region_alloc(r, sizeof(*nn_arch)*h->arch_count);
+    NN_ASSERT(nn_arch != NULL);
+    for (size_t i = 0; i < h->arch_count; ++i) nn_arch[i] = arch[i];
+    return nn_alloc(r, nn_arch, h->arch_count);
+}
+
+bool monitor_read_stats(const Monitor *m, Monitor_Stats *stats, size_t since, float *history, size_t *history_count)
+{
+    Monitor_Header *h = m->header;
+    const float *ring = (const float*)((const uint8_t*)h + h->history_offset);
+    for (size_t attempt = 0; attempt < 100; ++attempt) {
+        uint64_t s;
+        if (!monitor_read_begin(&h->stats_seq, &s)) return false;
+
+        Monitor_Stats result = {
+            .epoch = h->epoch,
+            .samples = h->samples,
+            .rate = h->rate,
+            .samples_per_sec = h->samples_per_sec,
+            .cost = h->cost,
+            .history_count = h->history_count,
+        };
+        size_t count = 0;
+        if (history != NULL && result.history_count > since) {
+            size_t total = result.history_count;
+            count = total - since;
+            if (count > h->history_cap) count = h->history_cap;
+            for (size_t i = 0; i < count; ++i) {
+                history[i] = ring[(total - count + i)%h->history_cap];
+            }
+        }
+
+        if (monitor_read_end(&h->stats_seq, s)) {
+            *stats = result;
+            if (history_count != NULL) *history_count = count;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool monitor_read_params(const Monitor *m, NN nn, uint64_t *version)
+{
+    Monitor_Header *h = m->header;
+    NN_ASSERT(nn_param_count(nn) == h->params_count);
+    for (size_t attempt = 0; attempt < 100; ++attempt) {
+        uint64_t s;
+        if (!monitor_read_begin(&h->params_seq, &s)) return false;
+        if (s/2 == *version) return false;
+
+        nn_params_set(nn, (const float*)((const uint8_t*)h + h->params_offset));
+
+        if (monitor_read_end(&h->params_seq, s)) {
+            *version = s/2;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void pool_run_task(Pool_Task task, void *arg, size_t index, size_t worker, Region *scratch)
+{
+    size_t s = region_save(scratch);
+    task(arg, index, worker);
+    region_rewind(scratch, s);
+}
+
+// pool_scratch(NULL, 0) of every thread, either the scratch of a worker or a
+// region owned by the thread
+static pthread_key_t pool_scratch_key;
+static pthread_once_t pool_scratch_once = PTHREAD_ONCE_INIT;
+
+static void pool_scratch_destroy(void *arg)
+{
+    Region *scratch = arg;
+    region_free(scratch);
+    NN_FREE(scratch);
+}
+
+static void pool_scratch_key_init(void)
+{
+    int err = pthread_key_create(&pool_scratch_key, pool_scratch_destroy);
+    NN_ASSERT(err == 0);
+}
+
+static void *pool_worker(void *arg)
+{
+    Pool_Worker *w = arg;
+    Pool *p = w->pool;
+    w->scratch = region_alloc_mmap(NN_POOL_SCRATCH_CAPACITY);
+    // Tasks calling pool_scratch(NULL, 0), e.g. through pool_run(NULL, ...),
+    // get the scratch of the worker instead of a region of their own
+    pthread_once(&pool_scratch_once, pool_scratch_key_init);
+    pthread_setspecific(pool_scratch_key, &w->scratch);
+    pthread_mutex_lock(&p->mutex);
+    for (;;) {
+        while (!p->quit && p->next >= p->count) {
+            pthread_cond_wait(&p->work_cond, &p->mutex);
+        }
+        if (p->quit) break;
+
+        size_t i = p->next++;
+        Pool_Task task = p->task;
+        void *task_arg = p->arg;
+        p->running += 1;
+        pthread_mutex_unlock(&p->mutex);
+        pool_run_task(task, task_arg, i, w->index, &w->scratch);
+        pthread_mutex_lock(&p->mutex);
+        p->running -= 1;
+
+        if (p->next >= p->count && p->running == 0) {
+            pthread_cond_signal(&p->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    // The scratch is freed by pool_free(), not by the destructor of the key
+    pthread_setspecific(pool_scratch_key, NULL);
+    return NULL;
+}
+
+bool pool_init(Pool *p, size_t workers_count)
+{
+    memset(p, 0, sizeof(*p));
+    if (workers_count == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        workers_count = n > 0 ? n : 1;
+    }
+
+    p->workers = nn_malloc(sizeof(*p->workers)*workers_count);
+    NN_ASSERT(p->workers != NULL);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+
+    for (size_t i = 0; i < workers_count; ++i) {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        int err = pthread_create(&p->workers[i].thread, NULL, pool_worker, &p->workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "ERROR: could not start pool worker: %s\n", strerror(err));
+            pool_free(p);
+            return false;
+        }
+        p->workers_count += 1;
+    }
+
+    return true;
+}
+
+void pool_run(Pool *p, size_t count, Pool_Task task, void *arg)
+{
+    if (p == NULL) {
+        Region *scratch = pool_scratch(NULL, 0);
+        for (size_t i = 0; i < count; ++i) pool_run_task(task, arg, i, 0, scratch);
+        return;
+    }
+    if (count == 0) return;
+
+    pthread_mutex_lock(&p->mutex);
+    NN_ASSERT(p->next >= p->count && p->running == 0 && "Only one pool_run() at a time");
+    p->task = task;
+    p->arg = arg;
+    p->next = 0;
+    p->count = count;
+    pthread_cond_broadcast(&p->work_cond);
+    while (p->next < p->count || p->running > 0) {
+        pthread_cond_wait(&p->done_cond, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void pool_free(Pool *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->quit = true;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->mutex);
+    for (size_t i = 0; i < p->workers_count; ++i) {
+        pthread_join(p->workers[i].thread, NULL);
+        region_free(&p->workers[i].scratch);
+    }
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_cond_destroy(&p->done_cond);
+    NN_FREE(p->workers);
+    memset(p, 0, sizeof(*p));
+}
+
+Region *pool_scratch(Pool *p, size_t worker)
+{
+    if (p == NULL) {
+        pthread_once(&pool_scratch_once, pool_scratch_key_init);
+        Region *scratch = pthread_getspecific(pool_scratch_key);
+        if (scratch == NULL) {
+            scratch = nn_malloc(sizeof(*scratch));
+            NN_ASSERT(scratch != NULL);
+            *scratch = region_alloc_mmap(NN_POOL_SCRATCH_CAPACITY);
+            pthread_setspecific(pool_scratch_key, scratch);
+        }
+        return scratch;
+    }
+    NN_ASSERT(worker < p->workers_count);
+    return &p->workers[worker].scratch;
+}
+
+void pool_scratch_release(void)
+{
+    pthread_once(&pool_scratch_once, pool_scratch_key_init);
+    Region *scratch = pthread_getspecific(pool_scratch_key);
+    if (scratch == NULL) return;
+    pthread_setspecific(pool_scratch_key, NULL);
+    pool_scratch_destroy(scratch);
+}
+
+bool image_set_save(Image_Set set, const char *file_path)
+{
+    FILE *f = fopen(file_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    Image_Set_Header h = {0};
+    memcpy(h.magic, IMAGE_SET_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_SET_VERSION;
+    h.count = set.count;
+    h.width = set.width;
+    h.height = set.height;
+    h.label_count = set.label_count;
+    h.fingerprint = set.fingerprint;
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(set.label_names, sizeof(*set.label_names), set.label_count, f);
+    fwrite(set.labels, sizeof(*set.labels), set.count, f);
+    fwrite(set.pixels, 1, set.count*set.width*set.height, f);
+
+    return nn_file_close(f, file_path, false);
+}
+
+static bool image_set_read_header(FILE *f, Image_Set_Header *h, const char *file_path)
+{
+    if (fread(h, sizeof(*h), 1, f) != 1 || memcmp(h->magic, IMAGE_SET_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not an image set file\n", file_path);
+        return false;
+    }
+    if (h->version != IMAGE_SET_VERSION) {
+        fprintf(stderr, "ERROR: %s has unsupported version %u, expected %u\n", file_path, h->version, IMAGE_SET_VERSION);
+        return false;
+    }
+    return true;
+}
+
+bool image_set_load(Region *r, Image_Set *set, const char *file_path)
+{
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    Image_Set_Header h;
+    if (!image_set_read_header(f, &h, file_path)) {
+        fclose(f);
+        return false;
+    }
+
+    Image_Set loaded = {0};
+    loaded.count = h.count;
+    loaded.width = h.width;
+    loaded.height = h.height;
+    loaded.label_count = h.label_count;
+    loaded.fingerprint = h.fingerprint;
+    loaded.label_names = region_alloc(r, sizeof(*loaded.label_names)*loaded.label_count);
+    loaded.labels = region_alloc(r, sizeof(*loaded.labels)*loaded.count);
+    loaded.pixels = region_alloc(r, loaded.count*loaded.width*loaded.height);
+    NN_ASSERT(loaded.label_names != NULL && loaded.labels != NULL && loaded.pixels != NULL);
+
+    if (fread(loaded.label_names, sizeof(*loaded.label_names), loaded.label_count, f) != loaded.label_count ||
+        fread(loaded.labels, sizeof(*loaded.labels), loaded.count, f) != loaded.count ||
+        fread(loaded.pixels, 1, loaded.count*loaded.width*loaded.height, f) != loaded.count*loaded.width*loaded.height) {
+        fprintf(stderr, "ERROR: %s is truncated\n", file_path);
+        fclose(f);
+        return false;
+    }
+
+    fclose(f);
+    *set = loaded;
+    return true;
+}
+
+#ifdef STBI_INCLUDE_STB_IMAGE_H
+typedef struct {
+    char *path;
+    size_t label;
+    bool ok;
+} Image_Set_File;
+
+typedef struct {
+    Image_Set_File *items;
+    size_t count;
+    size_t capacity;
+} Image_Set_Files;
+
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+} Image_Set_Names;
+
+static char *image_set_path_join(const char *dir_path, const char *name)
+{
+    size_t size = strlen(dir_path) + 1 + strlen(name) + 1;
+    char *path = nn_malloc(size);
+    NN_ASSERT(path != NULL);
+    snprintf(path, size, "%s/%s", dir_path, name);
+    return path;
+}
+
+static int image_set_compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+static int image_set_compare_files(const void *a, const void *b)
+{
+    return strcmp(((const Image_Set_File*)a)->path, ((const Image_Set_File*)b)->path);
+}
+
+static uint64_t image_set_fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool image_set_has_png_ext(const char *name)
+{
+    size_t n = strlen(name);
+    if (n < 4) return false;
+    const char *ext = name + n - 4;
+    return ext[0] == '.' &&
+        (ext[1] == 'p' || ext[1] == 'P') &&
+        (ext[2] == 'n' || ext[2] == 'N') &&
+        (ext[3] == 'g' || ext[3] == 'G');
+}
+
+// Lists the entries of dir_path sorted by name, skipping . and ..
+static bool image_set_list_dir(const char *dir_path, Image_Set_Names *names)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR: could not open directory %s: %s\n", dir_path, strerror(errno));
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        size_t size = strlen(ent->d_name) + 1;
+        char *name = nn_malloc(size);
+        NN_ASSERT(name != NULL);
+        memcpy(name, ent->d_name, size);
+        da_append(names, name);
+    }
+    closedir(dir);
+
+    qsort(names->items, names->count, sizeof(*names->items), image_set_compare_names);
+    return true;
+}
+
+static bool image_set_scan(const char *dir_path, size_t label, Image_Set_Files *files, uint64_t *fingerprint)
+{
+    Image_Set_Names names = {0};
+    bool result = image_set_list_dir(dir_path, &names);
+
+    for (size_t i = 0; i < names.count && result; ++i) {
+        char *path = image_set_path_join(dir_path, names.items[i]);
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            fprintf(stderr, "ERROR: could not stat %s: %s\n", path, strerror(errno));
+            result = false;
+        } else if (S_ISDIR(st.st_mode)) {
+            result = image_set_scan(path, label, files, fingerprint);
+        } else if (S_ISREG(st.st_mode) && image_set_has_png_ext(names.items[i])) {
+            uint64_t size = st.st_size;
+            int64_t mtime = st.st_mtime;
+            *fingerprint = image_set_fnv1a(*fingerprint, path, strlen(path) + 1);
+            *fingerprint = image_set_fnv1a(*fingerprint, &size, sizeof(size));
+            *fingerprint = image_set_fnv1a(*fingerprint, &mtime, sizeof(mtime));
+            Image_Set_File file = { .path = path, .label = label };
+            da_append(files, file);
+            continue;
+        }
+        NN_FREE(path);
+    }
+
+    for (size_t i = 0; i < names.count; ++i) NN_FREE(names.items[i]);
+    NN_FREE(names.items);
+    return result;
+}
+
+static bool image_set_cache_matches(const char *cache_path, uint64_t fingerprint)
+{
+    FILE *f = fopen(cache_path, "rb");
+    if (f == NULL) return false;
+    Image_Set_Header h;
+    bool result = fread(&h, sizeof(h), 1, f) == 1 &&
+        memcmp(h.magic, IMAGE_SET_MAGIC, sizeof(h.magic)) == 0 &&
+        h.version == IMAGE_SET_VERSION &&
+        h.fingerprint == fingerprint;
+    fclose(f);
+    return result;
+}
+
+typedef struct {
+    Image_Set_Files files;
+    Image_Set *set;
+} Image_Set_Decode;
+
+static void image_set_decode_task(void *arg, size_t i, size_t worker)
+{
+    (void) worker;
+    Image_Set_Decode *d = arg;
+    Image_Set_File *file = &d->files.items[i];
+
+    int w, h, comp;
+    uint8_t *pixels = stbi_load(file->path, &w, &h, &comp, 0);
+    if (pixels == NULL) {
+        fprintf(stderr, "ERROR: could not read image %s: %s\n", file->path, stbi_failure_reason());
+        return;
+    }
+
+    if (comp != 1) {
+        fprintf(stderr, "ERROR: %s is %d bits image. Only 8 bit grayscale images are supported\n", file->path, comp*8);
+    } else if ((size_t) w != d->set->width || (size_t) h != d->set->height) {
+        fprintf(stderr, "ERROR: %s size is %dx%d, expected %zux%zu\n", file->path, w, h, d->set->width, d->set->height);
+    } else {
+        memcpy(IMAGE_SET_AT(*d->set, i), pixels, w*h);
+        d->set->labels[i] = file->label;
+        file->ok = true;
+    }
+
+    stbi_image_free(pixels);
+}
+
+bool image_set_load_dir(Region *r, Image_Set *set, const char *dir_path, const char *cache_path, Pool *pool)
+{
+    bool result = true;
+    Image_Set_Names names = {0};
+    Image_Set_Files files = {0};
+    uint64_t fingerprint = 0xcbf29ce484222325ULL;
+    size_t labels_begin = 0;
+
+    if (!image_set_list_dir(dir_path, &names)) return false;
+
+    // Keep only the subdirectories, those are the labels
+    for (size_t i = 0; i < names.count; ++i) {
+        char *path = image_set_path_join(dir_path, names.items[i]);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            names.items[labels_begin++] = names.items[i];
+        } else {
+            NN_FREE(names.items[i]);
+        }
+        NN_FREE(path);
+    }
+    names.count = labels_begin;
+
+    if (names.count > 256) {
+        fprintf(stderr, "ERROR: %s has %zu subdirectories, at most 256 labels are supported\n", dir_path, names.count);
+        result = false;
+        goto defer;
+    }
+
+    for (size_t label = 0; label < names.count; ++label) {
+        char *path = image_set_path_join(dir_path, names.items[label]);
+        fingerprint = image_set_fnv1a(fingerprint, names.items[label], strlen(names.items[label]) + 1);
+        bool ok = image_set_scan(path, label, &files, &fingerprint);
+        NN_FREE(path);
+        if (!ok) {
+            result = false;
+            goto defer;
+        }
+    }
+
+    if (cache_path != NULL && image_set_cache_matches(cache_path, fingerprint)) {
+        result = image_set_load(r, set, cache_path);
+        goto defer;
+    }
+
+    if (files.count == 0) {
+        fprintf(stderr, "ERROR: no png images found in the subdirectories of %s\n", dir_path);
+        result = false;
+        goto defer;
+    }
+
+    qsort(files.items, files.count, sizeof(*files.items), image_set_compare_files);
+
+    int w, h, comp;
+    if (!stbi_info(files.items[0].path, &w, &h, &comp)) {
+        fprintf(stderr, "ERROR: could not read image %s: %s\n", files.items[0].path, stbi_failure_reason());
+        result = false;
+        goto defer;
+    }
+
+    Image_Set decoded = {0};
+    decoded.count = files.count;
+    decoded.width = w;
+    decoded.height = h;
+    decoded.label_count = names.count;
+    decoded.fingerprint = fingerprint;
+    decoded.label_names = region_alloc(r, sizeof(*decoded.label_names)*decoded.label_count);
+    decoded.labels = region_alloc(r, sizeof(*decoded.labels)*decoded.count);
+    decoded.pixels = region_alloc(r, decoded.count*decoded.width*decoded.height);
+    NN_ASSERT(decoded.label_names != NULL && decoded.labels != NULL && decoded.pixels != NULL);
+    for (size_t i = 0; i < names.count; ++i) {
+        snprintf(decoded.label_names[i], sizeof(*decoded.label_names), "%s", names.items[i]);
+    }
+
+    Image_Set_Decode d = {
+        .files = files,
+        .set = &decoded,
+    };
+    pool_run(pool, files.count, image_set_decode_task, &d);
+
+    for (size_t i = 0; i < files.count; ++i) {
+        if (!files.items[i].ok) {
+            result = false;
+            goto defer;
+        }
+    }
+
+    if (cache_path != NULL) image_set_save(decoded, cache_path);
+    *set = decoded;
+
+defer:
+    for (size_t i = 0; i < names.count; ++i) NN_FREE(names.items[i]);
+    NN_FREE(names.items);
+    for (size_t i = 0; i < files.count; ++i) NN_FREE(files.items[i].path);
+    NN_FREE(files.items);
+    return result;
+}
+#endif // STBI_INCLUDE_STB_IMAGE_H
+
+// IDX header is two zero bytes, the type of the elements (0x08 is uint8), the
+// amount of dimensions and every dimension as big-endian uint32. *size is the
+// size of the mapping, for image_set_idx_unmap().
+static const uint8_t *image_set_idx_map(const char *file_path, size_t dims_count, uint32_t *dims, size_t *size)
+{
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open file %s: %s\n", file_path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: could not stat file %s: %s\n", file_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    size_t header_size = 4 + 4*dims_count;
+    if ((size_t) st.st_size < header_size) {
+        fprintf(stderr, "ERROR: %s is not an IDX file\n", file_path);
+        close(fd);
+        return NULL;
+    }
+
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map file %s: %s\n", file_path, strerror(errno));
+        return NULL;
+    }
+
+    if (data[0] != 0 || data[1] != 0 || data[2] != 0x08 || data[3] != dims_count) {
+        fprintf(stderr, "ERROR: %s is not an IDX file of %zu dimensional uint8 data\n", file_path, dims_count);
+        munmap((void*) data, st.st_size);
+        return NULL;
+    }
+
+    // Every dim is checked against the bytes the file has left, so the
+    // product can not overflow
+    size_t elements_size = (size_t) st.st_size - header_size;
+    size_t expected = 1;
+    for (size_t i = 0; i < dims_count; ++i) {
+        const uint8_t *p = &data[4 + 4*i];
+        dims[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+        if (dims[i] == 0) {
+            fprintf(stderr, "ERROR: %s has an empty dimension %zu\n", file_path, i);
+            munmap((void*) data, st.st_size);
+            return NULL;
+        }
+        if (expected > elements_size/dims[i]) {
+            fprintf(stderr, "ERROR: %s is %zu bytes, too small for the dimension %zu of size %u\n", file_path, (size_t) st.st_size, i, dims[i]);
+            munmap((void*) data, st.st_size);
+            return NULL;
+        }
+        expected *= dims[i];
+    }
+
+    if (elements_size != expected) {
+        fprintf(stderr, "ERROR: %s is %zu bytes, expected %zu from the header\n", file_path, (size_t) st.st_size, header_size + expected);
+        munmap((void*) data, st.st_size);
+        return NULL;
+    }
+
+    madvise((void*) data, st.st_size, MADV_WILLNEED);
+    *size = st.st_size;
+    return data + header_size;
+}
+
+static void image_set_idx_unmap(const uint8_t *data, size_t dims_count, size_t size)
+{
+    if (data == NULL) return;
+    size_t header_size = 4 + 4*dims_count;
+    munmap((void*) (data - header_size), size);
+}
+
+bool image_set_load_idx(Region *r, Image_Set *set, const char *images_path, const char *labels_path)
+{
+    bool result = true;
+    Image_Set loaded = {0};
+    uint32_t dims[3];
+    uint32_t labels_count = 0;
+    size_t pixels_size = 0;
+    size_t labels_size = 0;
+    const uint8_t *labels = NULL;
+    const uint8_t *pixels = image_set_idx_map(images_path, 3, dims, &pixels_size);
+    if (pixels == NULL) {
+        result = false;
+        goto defer;
+    }
+
+    loaded.count = dims[0];
+    loaded.height = dims[1];
+    loaded.width = dims[2];
+    loaded.pixels = (uint8_t*) pixels;
+
+    if (labels_path != NULL) {
+        labels = image_set_idx_map(labels_path, 1, &labels_count, &labels_size);
+        if (labels == NULL) {
+            result = false;
+            goto defer;
+        }
+        if (labels_count != loaded.count) {
+            fprintf(stderr, "ERROR: %s has %u labels for %zu images in %s\n", labels_path, labels_count, loaded.count, images_path);
+            result = false;
+            goto defer;
+        }
+        loaded.labels = (uint8_t*) labels;
+
+        for (size_t i = 0; i < loaded.count; ++i) {
+            if (loaded.label_count <= loaded.labels[i]) loaded.label_count = loaded.labels[i] + 1;
+        }
+        loaded.label_names = region_alloc(r, sizeof(*loaded.label_names)*loaded.label_count);
+        NN_ASSERT(loaded.label_names != NULL);
+        for (size_t i = 0; i < loaded.label_count; ++i) {
+            snprintf(loaded.label_names[i], sizeof(*loaded.label_names), "%zu", i);
+        }
+    }
+
+    *set = loaded;
+
+defer:
+    // The set keeps both mappings, they only go away if loading failed
+    if (!result) {
+        image_set_idx_unmap(pixels, 3, pixels_size);
+        image_set_idx_unmap(labels, 1, labels_size);
+    }
+    return result;
+}
+
+Dataset dataset_from_mat(Mat t)
+{
+    Dataset ds = {0};
+    ds.kind = DATASET_MAT;
+    ds.rows = t.rows;
+    ds.cols = t.cols;
+    ds.mat = t;
+    return ds;
+}
+
+Dataset dataset_from_image_set(Image_Set set)
+{
+    Dataset ds = {0};
+    ds.kind = DATASET_IMAGE_SET;
+    ds.rows = set.count;
+    ds.cols = set.width*set.height + set.label_count;
+    ds.images = set;
+    return ds;
+}
+
+Dataset dataset_from_image_coords(Region *r, const Dataset_Image *images, size_t images_count)
+{
+    Dataset ds = {0};
+    ds.kind = DATASET_IMAGE_COORDS;
+    ds.cols = 4;
+    ds.coords_images_count = images_count;
+    ds.coords_images = region_alloc(r, sizeof(*ds.coords_images)*images_count);
+    NN_ASSERT(ds.coords_images != NULL);
+    ds.coords_offsets = region_alloc(r, sizeof(*ds.coords_offsets)*images_count);
+    NN_ASSERT(ds.coords_offsets != NULL);
+    for (size_t i = 0; i < images_count; ++i) {
+        ds.coords_images[i] = images[i];
+        ds.coords_offsets[i] = ds.rows;
+        ds.rows += images[i].width*images[i].height;
+    }
+    return ds;
+}
+
+Dataset dataset_alloc_columns(Region *r, size_t rows, const Dataset_Column *columns, size_t columns_count)
+{
+    Dataset ds = {0};
+    ds.kind = DATASET_COLUMNS;
+    ds.rows = rows;
+    ds.columns_count = columns_count;
+    ds.columns = region_alloc(r, sizeof(*ds.columns)*columns_count);
+    NN_ASSERT(ds.columns != NULL);
+    for (size_t i = 0; i < columns_count; ++i) {
+        ds.columns[i] = columns[i];
+        ds.cols += columns[i].count;
+        switch (columns[i].type) {
+        case COLUMN_F32: ds.stride += sizeof(float)*columns[i].count;    break;
+        case COLUMN_F16: ds.stride += sizeof(uint16_t)*columns[i].count; break;
+        case COLUMN_U8:  ds.stride += sizeof(uint8_t)*columns[i].count;  break;
+        default: NN_ASSERT(0 && "Unreachable");
+        }
+    }
+    ds.data = region_alloc(r, ds.stride*rows);
+    NN_ASSERT(ds.data != NULL);
+    return ds;
+}
+
+static size_t dataset_column_size(Column_Type type)
+{
+    switch (type) {
+    case COLUMN_F32: return sizeof(float);
+    case COLUMN_F16: return sizeof(uint16_t);
+    case COLUMN_U8:  return sizeof(uint8_t);
+    }
+    NN_ASSERT(0 && "Unreachable");
+    return 0;
+}
+
+// Finds the column group of col and the byte offset of col in the row
+static Dataset_Column dataset_locate(Dataset ds, size_t col, size_t *offset)
+{
+    NN_ASSERT(ds.kind == DATASET_COLUMNS);
+    *offset = 0;
+    for (size_t i = 0; i < ds.columns_count; ++i) {
+        size_t size = dataset_column_size(ds.columns[i].type);
+        if (col < ds.columns[i].count) {
+            *offset += col*size;
+            return ds.columns[i];
+        }
+        col -= ds.columns[i].count;
+        *offset += ds.columns[i].count*size;
+    }
+    NN_ASSERT(0 && "Column out of bounds");
+    return ds.columns[0];
+}
+
+void *dataset_at(Dataset ds, size_t row, size_t col)
+{
+    NN_ASSERT(row < ds.rows);
+    size_t offset;
+    dataset_locate(ds, col, &offset);
+    return &ds.data[row*ds.stride + offset];
+}
+
+void dataset_set(Dataset ds, size_t row, size_t col, float x)
+{
+    NN_ASSERT(row < ds.rows);
+    size_t offset;
+    Dataset_Column c = dataset_locate(ds, col, &offset);
+    void *p = &ds.data[row*ds.stride + offset];
+    x = (x - c.offset)/c.scale;
+    switch (c.type) {
+    case COLUMN_F32: memcpy(p, &x, sizeof(x)); break;
+    case COLUMN_F16: {
+        uint16_t h = f32_to_f16(x);
+        memcpy(p, &h, sizeof(h));
+    } break;
+    case COLUMN_U8: {
+        x = roundf(x);
+        if (x < 0) x = 0;
+        if (x > 255) x = 255;
+        *(uint8_t*)p = x;
+    } break;
+    default: NN_ASSERT(0 && "Unreachable");
+    }
+}
+
+void dataset_shuffle(Dataset *ds)
+{
+    if (ds->kind == DATASET_MAT) {
+        mat_shuffle_rows(ds->mat);
+        return;
+    }
+
+    size_t bits = 2;
+    while (bits < 64 && (1ULL << bits) < ds->rows) bits += 2;
+    ds->shuffle_half_bits = bits/2;
+    do {
+        ds->shuffle = rand_u64();
+    } while (ds->shuffle == 0);
+}
+
+static uint64_t dataset_hash(uint64_t x)
+{
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Maps i to its position in the shuffled order. A 4 round Feistel network is
+// a bijection over [0, 2^(2*half_bits)), applying it again while the result
+// is out of [0, rows) (cycle walking) makes it a bijection over [0, rows).
+static size_t dataset_index(Dataset ds, size_t i)
+{
+    if (ds.shuffle == 0) return i;
+
+    size_t half = ds.shuffle_half_bits;
+    uint64_t mask = half >= 64 ? ~0ULL : (1ULL << half) - 1;
+    uint64_t x = i;
+    do {
+        uint64_t l = (x >> half) & mask;
+        uint64_t r = x & mask;
+        for (uint64_t round = 0; round < 4; ++round) {
+            uint64_t f = dataset_hash(r ^ (ds.shuffle + round*0x9e3779b97f4a7c15ULL)) & mask;
+            uint64_t t = l ^ f;
+            l = r;
+            r = t;
+        }
+        x = (l << half) | r;
+    } while (x >= ds.rows);
+    return x;
+}
+
+Mat dataset_gather(Region *r, Dataset ds, size_t begin, size_t count)
+{
+    NN_ASSERT(begin + count <= ds.rows);
+
+    if (ds.kind == DATASET_MAT) {
+        return (Mat) {
+            .rows = count,
+            .cols = ds.mat.cols,
+            .stride = ds.mat.stride,
+            .elements = &MAT_AT(ds.mat, begin, 0),
+        };
+    }
+
+    Mat batch = mat_alloc(r, count, ds.cols);
+    for (size_t i = 0; i < count; ++i) {
+        size_t index = dataset_index(ds, begin + i);
+        Row dst = mat_row(batch, i);
+        switch (ds.kind) {
+        case DATASET_IMAGE_SET: {
+            size_t n = ds.images.width*ds.images.height;
+            const uint8_t *pixels = IMAGE_SET_AT(ds.images, index);
+            for (size_t j = 0; j < n; ++j) {
+                ROW_AT(dst, j) = pixels[j]/255.f;
+            }
+            for (size_t j = 0; j < ds.images.label_count; ++j) {
+                ROW_AT(dst, n + j) = ds.images.labels[index] == j ? 1.f : 0.f;
+            }
+        } break;
+
+        case DATASET_COLUMNS: {
+            const uint8_t *src = &ds.data[index*ds.stride];
+            float *out = dst.elements;
+            for (size_t c = 0; c < ds.columns_count; ++c) {
+                Dataset_Column col = ds.columns[c];
+                switch (col.type) {
+                case COLUMN_F32:
+                    for (size_t j = 0; j < col.count; ++j) {
+                        float x;
+                        memcpy(&x, src + j*sizeof(x), sizeof(x));
+                        out[j] = x*col.scale + col.offset;
+                    }
+                    break;
+                case COLUMN_F16:
+                    for (size_t j = 0; j < col.count; ++j) {
+                        uint16_t x;
+                        memcpy(&x, src + j*sizeof(x), sizeof(x));
+                        out[j] = f16_to_f32(x)*col.scale + col.offset;
+                    }
+                    break;
+                case COLUMN_U8:
+                    for (size_t j = 0; j < col.count; ++j) {
+                        out[j] = src[j]*col.scale + col.offset;
+                    }
+                    break;
+                default:
+                    NN_ASSERT(0 && "Unreachable");
+                }
+                src += col.count*dataset_column_size(col.type);
+                out += col.count;
+            }
+        } break;
+
+        case DATASET_IMAGE_COORDS: {
+            // Binary search for the image the row belongs to
+            size_t lo = 0, hi = ds.coords_images_count;
+            while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo)/2;
+                if (ds.coords_offsets[mid] <= index) lo = mid; else hi = mid;
+            }
+            Dataset_Image image = ds.coords_images[lo];
+            size_t px = index - ds.coords_offsets[lo];
+            size_t x = px%image.width;
+            size_t y = px/image.width;
+            ROW_AT(dst, 0) = (float)x/(image.width - 1);
+            ROW_AT(dst, 1) = (float)y/(image.height - 1);
+            ROW_AT(dst, 2) = (float)lo;
+            ROW_AT(dst, 3) = image.pixels[px]/255.f;
+        } break;
+
+        default:
+            NN_ASSERT(0 && "Unreachable");
+        }
+    }
+    return batch;
+}
+
+void dataset_batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Dataset ds, float rate)
+{
+    if (b->finished) {
+        b->finished = false;
+        b->begin = 0;
+        b->cost = 0;
+    }
+
+    size_t size = batch_size;
+    if (b->begin + batch_size >= ds.rows)  {
+        size = ds.rows - b->begin;
+    }
+
+    Mat batch_t = dataset_gather(r, ds, b->begin, size);
+    NN g = nn_backprop(r, nn, batch_t);
+    nn_learn(nn, g, rate);
+    b->cost += nn_cost(nn, batch_t);
+    b->begin += batch_size;
+
+    if (b->begin >= ds.rows) {
+        size_t batch_count = (ds.rows + batch_size - 1)/batch_size;
+        b->cost /= batch_count;
+        b->finished = true;
+    }
+}
+
+float dataset_cost(Region *r, NN nn, Dataset ds)
+{
+    size_t chunk = 1024;
+    float c = 0;
+    for (size_t begin = 0; begin < ds.rows; begin += chunk) {
+        size_t count = ds.rows - begin < chunk ? ds.rows - begin : chunk;
+        size_t s = region_save(r);
+        c += nn_cost(nn, dataset_gather(r, ds, begin, count))*count;
+        region_rewind(r, s);
+    }
+    return ds.rows > 0 ? c/ds.rows : 0;
+}
+
+float f16_to_f32(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    uint32_t bits;
+    if (exp == 0x1F) {
+        bits = sign | 0x7F800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    } else if (mant != 0) {
+        // Subnormal, normalize it
+        exp = 127 - 15 + 1;
+        while ((mant & 0x400) == 0) {
+            mant <<= 1;
+            exp -= 1;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+    } else {
+        bits = sign;
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+uint16_t f32_to_f16(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exp = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mant = bits & 0x7FFFFF;
+
+    if (((bits >> 23) & 0xFF) == 0xFF) return sign | 0x7C00 | (mant ? 0x200 : 0);
+    if (exp >= 0x1F) return sign | 0x7C00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        // Subnormal, round to nearest even
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))) half += 1;
+        return sign | half;
+    }
+
+    uint16_t h = sign | (exp << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1FFF;
+    // Round to nearest even, carrying into the exponent is what we want
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h += 1;
+    return h;
+}
+
 #endif // NN_IMPLEMENTATION